@@ -1,11 +1,93 @@
 #pragma once
 #include <spdlog/spdlog.h>
+#include <log_limit.h>
 
-#define LOG_TRACE    SPDLOG_TRACE
-#define LOG_DEBUG    SPDLOG_DEBUG
-#define LOG_INFO    SPDLOG_INFO
-#define LOG_WARN    SPDLOG_WARN
-#define LOG_ERROR    SPDLOG_ERROR
-#define LOG_CRITICAL    SPDLOG_CRITICAL
+#include <cstdint>
 
-void spdlog_default_initialize();
\ No newline at end of file
+void spdlog_default_initialize();
+
+// Compile-time log levels.
+//
+// SPDLOG_ACTIVE_LEVEL is the level of the whole build; spdlog/tweakme.h sets
+// it per configuration. LOG_MODULE_LEVEL raises it for one source file: define
+// it before including this header, or #undef and redefine it after.
+//
+// A LOG_* statement below either level compiles to nothing and its arguments
+// are not evaluated. They are still compiled, so a disabled statement cannot
+// rot or leave a variable unused. Enabled statements are filtered by the
+// runtime level as before.
+#if !defined(LOG_MODULE_LEVEL)
+#define LOG_MODULE_LEVEL    SPDLOG_LEVEL_TRACE
+#endif
+
+#define LOG_ENABLED(level)    ((level) >= SPDLOG_ACTIVE_LEVEL && (level) >= LOG_MODULE_LEVEL)
+
+#if defined(LIBINCLUDE_BINARY_LOG)
+
+// Binary logging build: statements record their arguments instead of
+// formatting them. See binary_log.h.
+#include <binary_log.h>
+
+#define LIBINCLUDE_LOG_CALL(level, ...) \
+    do \
+    { \
+        static constexpr binary_log_site libinclude_log_site{ __FILE__, __LINE__, SPDLOG_FUNCTION, level }; \
+        if (spdlog::default_logger_raw()->should_log(level)) \
+            binary_log::write(libinclude_log_site, __VA_ARGS__); \
+    } while (0)
+
+#else
+
+#define LIBINCLUDE_LOG_CALL(level, ...) \
+    SPDLOG_LOGGER_CALL(spdlog::default_logger_raw(), level, __VA_ARGS__)
+
+#endif
+
+#define LIBINCLUDE_LOG(active_level, ...) \
+    do \
+    { \
+        if constexpr (LOG_ENABLED(active_level)) \
+            LIBINCLUDE_LOG_CALL(static_cast<spdlog::level::level_enum>(active_level), __VA_ARGS__); \
+    } while (0)
+
+// Sampled and rate-limited statements for hot handlers. LOG_*_EVERY_N(n, ...)
+// logs the first of every n calls; LOG_*_RATE(per_second, ...) logs at most
+// per_second a second, in bursts of up to that many. Before a statement logs
+// again, it logs how many of its calls were suppressed. Calls below the
+// runtime level are not counted. See log_limit.h.
+#define LIBINCLUDE_LOG_LIMITED(active_level, limit_type, limit, ...) \
+    do \
+    { \
+        if constexpr (LOG_ENABLED(active_level)) \
+        { \
+            static limit_type libinclude_log_limit; \
+            std::uint64_t libinclude_log_suppressed = 0; \
+            if (spdlog::default_logger_raw()->should_log(static_cast<spdlog::level::level_enum>(active_level)) \
+                && libinclude_log_limit.allow(limit, libinclude_log_suppressed)) \
+            { \
+                if (libinclude_log_suppressed != 0) \
+                    LIBINCLUDE_LOG_CALL(static_cast<spdlog::level::level_enum>(active_level), \
+                        "{} messages suppressed since the last one", libinclude_log_suppressed); \
+                LIBINCLUDE_LOG_CALL(static_cast<spdlog::level::level_enum>(active_level), __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+#define LOG_TRACE(...)    LIBINCLUDE_LOG(SPDLOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...)    LIBINCLUDE_LOG(SPDLOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)    LIBINCLUDE_LOG(SPDLOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...)    LIBINCLUDE_LOG(SPDLOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...)    LIBINCLUDE_LOG(SPDLOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_CRITICAL(...)    LIBINCLUDE_LOG(SPDLOG_LEVEL_CRITICAL, __VA_ARGS__)
+
+#define LOG_TRACE_EVERY_N(n, ...)    LIBINCLUDE_LOG_LIMITED(SPDLOG_LEVEL_TRACE, log_every_n, n, __VA_ARGS__)
+#define LOG_DEBUG_EVERY_N(n, ...)    LIBINCLUDE_LOG_LIMITED(SPDLOG_LEVEL_DEBUG, log_every_n, n, __VA_ARGS__)
+#define LOG_INFO_EVERY_N(n, ...)    LIBINCLUDE_LOG_LIMITED(SPDLOG_LEVEL_INFO, log_every_n, n, __VA_ARGS__)
+#define LOG_WARN_EVERY_N(n, ...)    LIBINCLUDE_LOG_LIMITED(SPDLOG_LEVEL_WARN, log_every_n, n, __VA_ARGS__)
+#define LOG_ERROR_EVERY_N(n, ...)    LIBINCLUDE_LOG_LIMITED(SPDLOG_LEVEL_ERROR, log_every_n, n, __VA_ARGS__)
+
+#define LOG_TRACE_RATE(per_second, ...)    LIBINCLUDE_LOG_LIMITED(SPDLOG_LEVEL_TRACE, log_rate_limit, per_second, __VA_ARGS__)
+#define LOG_DEBUG_RATE(per_second, ...)    LIBINCLUDE_LOG_LIMITED(SPDLOG_LEVEL_DEBUG, log_rate_limit, per_second, __VA_ARGS__)
+#define LOG_INFO_RATE(per_second, ...)    LIBINCLUDE_LOG_LIMITED(SPDLOG_LEVEL_INFO, log_rate_limit, per_second, __VA_ARGS__)
+#define LOG_WARN_RATE(per_second, ...)    LIBINCLUDE_LOG_LIMITED(SPDLOG_LEVEL_WARN, log_rate_limit, per_second, __VA_ARGS__)
+#define LOG_ERROR_RATE(per_second, ...)    LIBINCLUDE_LOG_LIMITED(SPDLOG_LEVEL_ERROR, log_rate_limit, per_second, __VA_ARGS__)
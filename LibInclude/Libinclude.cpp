@@ -1,4 +1,4 @@
-#include <Libinclude.h>
+#include <LibInclude.h>
 
 void spdlog_default_initialize()
 {
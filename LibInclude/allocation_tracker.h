@@ -0,0 +1,229 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Totals reported by allocation_tracker. An operation is whatever unit of work
+// the caller counts with allocation_tracker::count_operation(), for example one
+// echoed message, so the ratios read as "per message".
+struct allocation_counters
+{
+    std::uint64_t allocations = 0;
+    std::uint64_t deallocations = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t fallbacks = 0;
+    std::uint64_t operations = 0;
+
+    double allocations_per_op() const
+    {
+        return operations ? static_cast<double>(allocations) / operations : 0.0;
+    }
+
+    double bytes_per_op() const
+    {
+        return operations ? static_cast<double>(bytes) / operations : 0.0;
+    }
+
+    // Share of allocations that a custom allocator could not serve and passed
+    // on to the heap.
+    double fallback_rate() const
+    {
+        return allocations ? static_cast<double>(fallbacks) / allocations : 0.0;
+    }
+
+    allocation_counters& operator+=(const allocation_counters& other)
+    {
+        allocations += other.allocations;
+        deallocations += other.deallocations;
+        bytes += other.bytes;
+        fallbacks += other.fallbacks;
+        operations += other.operations;
+        return *this;
+    }
+
+    // The difference between two snapshots covers the work done in between.
+    allocation_counters operator-(const allocation_counters& earlier) const
+    {
+        allocation_counters d;
+        d.allocations = allocations - earlier.allocations;
+        d.deallocations = deallocations - earlier.deallocations;
+        d.bytes = bytes - earlier.bytes;
+        d.fallbacks = fallbacks - earlier.fallbacks;
+        d.operations = operations - earlier.operations;
+        return d;
+    }
+};
+
+// Process-wide allocation counts. Each thread increments its own counters, so
+// counting costs a few uncontended relaxed stores and never takes a lock;
+// snapshot() sums every thread's counters, including threads that have exited.
+class allocation_tracker
+{
+public:
+    static void count_allocation(std::size_t bytes)
+    {
+        thread_counters& c = local();
+        add(c.allocations, 1);
+        add(c.bytes, bytes);
+    }
+
+    static void count_deallocation()
+    {
+        add(local().deallocations, 1);
+    }
+
+    // An allocation a custom allocator passed on to the heap. It is also
+    // counted as an allocation by whoever made the request.
+    static void count_fallback()
+    {
+        add(local().fallbacks, 1);
+    }
+
+    static void count_operation(std::uint64_t n = 1)
+    {
+        add(local().operations, n);
+    }
+
+    static allocation_counters snapshot()
+    {
+        registry& r = get_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        allocation_counters total = r.retired;
+        for (const thread_counters* c : r.live)
+            total += load(*c);
+        return total;
+    }
+
+private:
+    struct thread_counters
+    {
+        std::atomic<std::uint64_t> allocations{ 0 };
+        std::atomic<std::uint64_t> deallocations{ 0 };
+        std::atomic<std::uint64_t> bytes{ 0 };
+        std::atomic<std::uint64_t> fallbacks{ 0 };
+        std::atomic<std::uint64_t> operations{ 0 };
+    };
+
+    struct registry
+    {
+        std::mutex mutex;
+        std::vector<const thread_counters*> live;
+        allocation_counters retired;
+    };
+
+    // Registers the thread's counters on first use and folds them into the
+    // retired totals when the thread exits.
+    struct thread_entry
+    {
+        thread_entry()
+        {
+            registry& r = get_registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.live.push_back(&counters);
+        }
+
+        ~thread_entry()
+        {
+            registry& r = get_registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.retired += load(counters);
+            r.live.erase(std::find(r.live.begin(), r.live.end(), &counters));
+        }
+
+        thread_counters counters;
+    };
+
+    static registry& get_registry()
+    {
+        static registry r;
+        return r;
+    }
+
+    static thread_counters& local()
+    {
+        thread_local thread_entry entry;
+        return entry.counters;
+    }
+
+    // Only the owning thread writes its counters, so a read-modify-write is
+    // not needed; the atomics only make concurrent snapshots well defined.
+    static void add(std::atomic<std::uint64_t>& counter, std::uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static allocation_counters load(const thread_counters& c)
+    {
+        allocation_counters result;
+        result.allocations = c.allocations.load(std::memory_order_relaxed);
+        result.deallocations = c.deallocations.load(std::memory_order_relaxed);
+        result.bytes = c.bytes.load(std::memory_order_relaxed);
+        result.fallbacks = c.fallbacks.load(std::memory_order_relaxed);
+        result.operations = c.operations.load(std::memory_order_relaxed);
+        return result;
+    }
+};
+
+// Allocator adaptor that reports every allocation to allocation_tracker and
+// then forwards it to the wrapped allocator. Bind it to a handler to count
+// what asio allocates for the operation:
+//
+//   asio::bind_allocator(counting_allocator<int>(), handler)
+//   asio::bind_allocator(counting_allocator<int, handler_allocator<int>>(handler_allocator<int>(memory)), handler)
+template <typename T, typename Allocator = std::allocator<T>>
+class counting_allocator
+{
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = counting_allocator<U, typename std::allocator_traits<Allocator>::template rebind_alloc<U>>;
+    };
+
+    counting_allocator() = default;
+
+    explicit counting_allocator(const Allocator& inner)
+        : inner_(inner)
+    {
+    }
+
+    template <typename U, typename OtherAllocator>
+    counting_allocator(const counting_allocator<U, OtherAllocator>& other) noexcept
+        : inner_(other.inner_)
+    {
+    }
+
+    bool operator==(const counting_allocator& other) const noexcept
+    {
+        return inner_ == other.inner_;
+    }
+
+    bool operator!=(const counting_allocator& other) const noexcept
+    {
+        return inner_ != other.inner_;
+    }
+
+    T* allocate(std::size_t n)
+    {
+        T* p = std::allocator_traits<Allocator>::allocate(inner_, n);
+        allocation_tracker::count_allocation(sizeof(T) * n);
+        return p;
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        allocation_tracker::count_deallocation();
+        std::allocator_traits<Allocator>::deallocate(inner_, p, n);
+    }
+
+private:
+    template <typename, typename> friend class counting_allocator;
+
+    Allocator inner_;
+};
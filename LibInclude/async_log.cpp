@@ -0,0 +1,362 @@
+#include <LibInclude.h>
+#include <async_log.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <utility>
+
+namespace
+{
+    std::atomic<std::uint64_t> next_writer_id{ 1 };
+}
+
+//----------------------------------------------------------------------
+
+async_record_writer::async_record_writer(async_log_options options)
+    : options_(options),
+    id_(next_writer_id.fetch_add(1, std::memory_order_relaxed)),
+    stop_(false),
+    flush_requested_(0),
+    flush_done_(0),
+    parked_(false),
+    dropped_(0),
+    dropped_reported_(0),
+    dropped_reported_at_(std::chrono::steady_clock::now())
+{
+}
+
+async_record_writer::~async_record_writer()
+{
+    stop();
+}
+
+void async_record_writer::start()
+{
+    thread_ = std::thread([this]() { run(); });
+}
+
+// Writes out everything pushed so far before the thread ends.
+void async_record_writer::stop()
+{
+    if (!thread_.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+}
+
+record_ring& async_record_writer::local_ring()
+{
+    // The rings this thread pushes into, one per writer. Destroyed when the
+    // thread exits, which tells the background threads to retire them.
+    struct thread_rings
+    {
+        ~thread_rings()
+        {
+            for (auto& entry : entries)
+                entry.second->close();
+        }
+
+        std::vector<std::pair<std::uint64_t, std::shared_ptr<record_ring>>> entries;
+    };
+    static thread_local thread_rings rings;
+
+    for (auto& entry : rings.entries)
+    {
+        if (entry.first == id_)
+            return *entry.second;
+    }
+
+    auto r = std::make_shared<record_ring>(options_.ring_bytes);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rings_.push_back(r);
+    }
+    rings.entries.emplace_back(id_, r);
+    return *r;
+}
+
+void async_record_writer::flush_records()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::uint64_t ticket = ++flush_requested_;
+    wake_.notify_one();
+    flushed_.wait(lock, [this, ticket]() { return flush_done_ >= ticket; });
+}
+
+void async_record_writer::run()
+{
+    // Records written per pass, so that flush and stop requests are seen
+    // while logging threads keep the rings busy.
+    constexpr std::size_t pass_limit = 1024;
+
+    std::vector<std::shared_ptr<record_ring>> rings;
+    std::vector<std::size_t> targets;
+
+    // Output is also flushed whenever the rings run dry, so what has been
+    // logged reaches its destination without waiting for a flush request.
+    bool unflushed = false;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;)
+    {
+        std::erase_if(rings_, [](const std::shared_ptr<record_ring>& r) { return r->closed() && r->empty(); });
+        rings = rings_;
+        bool stopping = stop_;
+        std::uint64_t flush_target = flush_requested_;
+        lock.unlock();
+
+        std::size_t drained = 0;
+        bool flushing = stopping || flush_target != flush_done_;
+        if (flushing)
+        {
+            // Everything pushed before the request must be out; records
+            // pushed since may go out too.
+            targets.clear();
+            for (auto& r : rings)
+                targets.push_back(r->written());
+
+            for (std::size_t i = 0; i < rings.size(); )
+            {
+                if (rings[i]->read() >= targets[i])
+                    ++i;
+                else
+                    drained += drain(rings, pass_limit);
+            }
+        }
+        else
+        {
+            drained = drain(rings, pass_limit);
+        }
+
+        check_dropped();
+        if (flushing || (drained == 0 && unflushed))
+            flush_output();
+        unflushed = drained != 0 && !flushing;
+
+        lock.lock();
+        if (flushing)
+        {
+            flush_done_ = flush_target;
+            flushed_.notify_all();
+        }
+        if (stopping)
+            return;
+        if (drained == 0 && !stop_ && flush_requested_ == flush_done_)
+            park(lock);
+    }
+}
+
+// Wait, with the mutex held, until a push, flush or stop needs the thread.
+void async_record_writer::park(std::unique_lock<std::mutex>& lock)
+{
+    parked_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    // A record pushed before its producer could see parked_ is found here;
+    // one pushed after is followed by wake(). Rings are only added under the
+    // mutex, so rings_ is complete.
+    bool idle = std::all_of(rings_.begin(), rings_.end(),
+        [](const std::shared_ptr<record_ring>& r) { return r->empty(); });
+    if (idle)
+    {
+        auto woken = [this]() { return !parked_.load(std::memory_order_relaxed) || stop_ || flush_requested_ != flush_done_; };
+
+        // Dropped records are reported about once a second, so a count not
+        // yet reported bounds the wait.
+        if (dropped_.load(std::memory_order_relaxed) != dropped_reported_)
+            wake_.wait_until(lock, dropped_reported_at_ + std::chrono::seconds(1), woken);
+        else
+            wake_.wait(lock, woken);
+    }
+    parked_.store(false, std::memory_order_relaxed);
+}
+
+void async_record_writer::wake()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        parked_.store(false, std::memory_order_relaxed);
+    }
+    wake_.notify_one();
+}
+
+// The block policy's wait for room: yield while the background thread is
+// likely to free some soon, then sleep, doubling up to a millisecond, so that
+// a thread stuck behind slow sinks stops burning a core.
+void async_record_writer::back_off(unsigned attempt)
+{
+    constexpr unsigned yields = 16;
+    if (attempt < yields)
+        std::this_thread::yield();
+    else
+        std::this_thread::sleep_for(std::chrono::microseconds(16u << std::min(attempt - yields, 6u)));
+}
+
+std::size_t async_record_writer::drain(const std::vector<std::shared_ptr<record_ring>>& rings, std::size_t limit)
+{
+    std::size_t drained = 0;
+    while (drained < limit)
+    {
+        // Merge the rings by time, so records from different threads come
+        // out in the order they were pushed.
+        record_ring* oldest = nullptr;
+        const void* first = nullptr;
+        spdlog::log_clock::time_point first_time;
+        for (auto& r : rings)
+        {
+            const void* candidate = r->front();
+            if (candidate == nullptr)
+                continue;
+
+            spdlog::log_clock::time_point time;
+            std::memcpy(&time, candidate, sizeof(time));
+            if (first == nullptr || time < first_time)
+            {
+                oldest = r.get();
+                first = candidate;
+                first_time = time;
+            }
+        }
+        if (oldest == nullptr)
+            break;
+
+        write_record(first);
+        oldest->pop();
+        ++drained;
+    }
+    return drained;
+}
+
+void async_record_writer::check_dropped()
+{
+    std::uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+    if (dropped == dropped_reported_)
+        return;
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - dropped_reported_at_ < std::chrono::seconds(1) && !stop_)
+        return;
+
+    report_dropped(dropped - dropped_reported_);
+    dropped_reported_ = dropped;
+    dropped_reported_at_ = now;
+}
+
+//----------------------------------------------------------------------
+
+namespace
+{
+    // What async_log_sink::log() stores in the ring: the message's fields,
+    // followed by the logger name and the formatted text.
+    struct log_record
+    {
+        spdlog::log_clock::time_point time;
+        std::uint32_t name_size;
+        std::uint32_t payload_size;
+        spdlog::level::level_enum level;
+        std::size_t thread_id;
+        spdlog::source_loc source;
+
+        const char* name() const
+        {
+            return reinterpret_cast<const char*>(this + 1);
+        }
+
+        const char* payload() const
+        {
+            return name() + name_size;
+        }
+    };
+}
+
+async_log_sink::async_log_sink(std::vector<spdlog::sink_ptr> sinks, async_log_options options)
+    : async_record_writer(options),
+    sinks_(std::move(sinks))
+{
+    start();
+}
+
+async_log_sink::~async_log_sink()
+{
+    stop();
+}
+
+void async_log_sink::log(const spdlog::details::log_msg& msg)
+{
+    record_ring& ring = local_ring();
+    std::size_t name_size = std::min<std::size_t>(msg.logger_name.size(), 255);
+    std::size_t payload_size = std::min(msg.payload.size(), ring.max_record() - sizeof(log_record) - name_size);
+    push(ring, sizeof(log_record) + name_size + payload_size,
+        [&](void* p)
+        {
+            log_record* r = ::new (p) log_record{ msg.time, static_cast<std::uint32_t>(name_size),
+                static_cast<std::uint32_t>(payload_size), msg.level, msg.thread_id, msg.source };
+            char* text = reinterpret_cast<char*>(r + 1);
+            std::memcpy(text, msg.logger_name.data(), name_size);
+            std::memcpy(text + name_size, msg.payload.data(), payload_size);
+        });
+}
+
+void async_log_sink::flush()
+{
+    flush_records();
+}
+
+void async_log_sink::set_pattern(const std::string& pattern)
+{
+    for (auto& sink : sinks_)
+        sink->set_pattern(pattern);
+}
+
+void async_log_sink::set_formatter(std::unique_ptr<spdlog::formatter> sink_formatter)
+{
+    for (std::size_t i = 0; i < sinks_.size(); ++i)
+        sinks_[i]->set_formatter(i + 1 == sinks_.size() ? std::move(sink_formatter) : sink_formatter->clone());
+}
+
+void async_log_sink::write_record(const void* record)
+{
+    auto r = static_cast<const log_record*>(record);
+    spdlog::details::log_msg msg(r->time, r->source, spdlog::string_view_t(r->name(), r->name_size), r->level,
+        spdlog::string_view_t(r->payload(), r->payload_size));
+    msg.thread_id = r->thread_id;
+    write(msg);
+}
+
+void async_log_sink::flush_output()
+{
+    for (auto& sink : sinks_)
+        sink->flush();
+}
+
+void async_log_sink::report_dropped(std::uint64_t count)
+{
+    std::string text = fmt::format("async log dropped {} messages, ring full", count);
+    write(spdlog::details::log_msg(spdlog::string_view_t(), spdlog::level::warn, text));
+}
+
+void async_log_sink::write(const spdlog::details::log_msg& msg)
+{
+    for (auto& sink : sinks_)
+    {
+        if (sink->should_log(msg.level))
+            sink->log(msg);
+    }
+}
+
+//----------------------------------------------------------------------
+
+void spdlog_async_initialize(async_log_options options)
+{
+    std::vector<spdlog::sink_ptr> sinks{ std::make_shared<spdlog::sinks::stdout_color_sink_mt>() };
+    auto sink = std::make_shared<async_log_sink>(std::move(sinks), options);
+    spdlog::set_default_logger(std::make_shared<spdlog::logger>("", std::move(sink)));
+    spdlog_default_initialize();
+}
@@ -0,0 +1,178 @@
+#pragma once
+#include <spdlog/spdlog.h>
+#include <record_ring.h>
+#include <spdlog/sinks/sink.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// What a logging thread does when its ring is full.
+enum class async_overflow_policy
+{
+    // Wait for the background thread to make room, yielding at first and
+    // then sleeping for up to a millisecond at a time. Nothing is lost, but a
+    // thread that logs faster than the sinks can write is slowed to their pace.
+    block,
+
+    // Discard the message and count it. The background thread reports the
+    // count about once a second.
+    drop
+};
+
+struct async_log_options
+{
+    // Bytes of ring per logging thread, rounded up to a power of two. A
+    // message longer than a quarter of this is truncated.
+    std::size_t ring_bytes = 1 << 20;
+
+    async_overflow_policy overflow = async_overflow_policy::block;
+};
+
+// Per-thread record rings drained by one background thread.
+//
+// Each thread that pushes gets its own record_ring on its first record, so
+// pushing is a copy into memory only that thread writes: no lock, no
+// allocation and no system call. The background thread merges the rings,
+// oldest record first, and hands each record to write_record(). When every
+// ring is empty it parks until a push finds it parked; pushes made while it
+// is awake cost a fence and a load.
+//
+// Every record must begin with the spdlog::log_clock::time_point it is
+// ordered by. Derived classes call start() once constructed and stop() in
+// their destructor, before anything write_record() uses is destroyed.
+class async_record_writer
+{
+public:
+    async_record_writer(const async_record_writer&) = delete;
+    async_record_writer& operator=(const async_record_writer&) = delete;
+
+    // Records discarded by the drop policy so far.
+    std::uint64_t dropped() const
+    {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+protected:
+    explicit async_record_writer(async_log_options options);
+    virtual ~async_record_writer();
+
+    void start();
+    void stop();
+
+    // The calling thread's ring, created on first use.
+    record_ring& local_ring();
+
+    // Push a record of bytes bytes, at most ring.max_record(), which
+    // fill(void*) writes in place. A full ring is handled by the overflow
+    // policy.
+    template <typename F>
+    void push(record_ring& ring, std::size_t bytes, F&& fill)
+    {
+        if (!ring.try_push(bytes, fill))
+        {
+            if (options_.overflow == async_overflow_policy::drop)
+            {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            // The ring is not empty, so the background thread is awake and
+            // will make room.
+            for (unsigned attempt = 0; !ring.try_push(bytes, fill); ++attempt)
+                back_off(attempt);
+        }
+
+        // Pairs with the fence in park(): either the background thread sees
+        // this record when it looks at the rings before waiting, or this
+        // sees it parked and wakes it.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked_.load(std::memory_order_relaxed))
+            wake();
+    }
+
+    // Wait until every record pushed before the call has been written and
+    // flush_output() has run.
+    void flush_records();
+
+    // Background thread.
+    virtual void write_record(const void* record) = 0;
+    virtual void flush_output() = 0;
+    virtual void report_dropped(std::uint64_t count) = 0;
+
+    const async_log_options options_;
+
+private:
+    void run();
+    void park(std::unique_lock<std::mutex>& lock);
+    void wake();
+    static void back_off(unsigned attempt);
+    std::size_t drain(const std::vector<std::shared_ptr<record_ring>>& rings, std::size_t limit);
+    void check_dropped();
+
+    const std::uint64_t id_;
+
+    // Rings of every thread that has pushed here. Threads add theirs on their
+    // first record; the background thread removes rings of exited threads
+    // once they are empty.
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable flushed_;
+    std::vector<std::shared_ptr<record_ring>> rings_;
+    bool stop_;
+    std::uint64_t flush_requested_;
+    std::uint64_t flush_done_;
+
+    // Set while the background thread waits with every ring empty. Cleared
+    // under the mutex by whoever wakes it.
+    std::atomic<bool> parked_;
+
+    std::atomic<std::uint64_t> dropped_;
+    std::uint64_t dropped_reported_;
+    std::chrono::steady_clock::time_point dropped_reported_at_;
+
+    std::thread thread_;
+};
+
+// spdlog sink that moves the writing of log messages off the calling thread.
+// log() copies the formatted message into the thread's ring; the background
+// thread passes the messages to the wrapped sinks, in the order they were
+// logged across all threads.
+//
+// The LOG_* macros still format on the calling thread; only the sink work
+// moves. flush() waits until everything logged before it has been written.
+class async_log_sink
+    : public spdlog::sinks::sink,
+    private async_record_writer
+{
+public:
+    explicit async_log_sink(std::vector<spdlog::sink_ptr> sinks, async_log_options options = async_log_options());
+    ~async_log_sink();
+
+    void log(const spdlog::details::log_msg& msg) override;
+    void flush() override;
+    void set_pattern(const std::string& pattern) override;
+    void set_formatter(std::unique_ptr<spdlog::formatter> sink_formatter) override;
+
+    using async_record_writer::dropped;
+
+private:
+    void write_record(const void* record) override;
+    void flush_output() override;
+    void report_dropped(std::uint64_t count) override;
+
+    void write(const spdlog::details::log_msg& msg);
+
+    std::vector<spdlog::sink_ptr> sinks_;
+};
+
+// Replace the default logger with one that writes to the console through an
+// async_log_sink, then apply the spdlog_default_initialize() pattern and level.
+void spdlog_async_initialize(async_log_options options = async_log_options());
@@ -0,0 +1,200 @@
+#pragma once
+#include <LibInclude.h>
+#include <command_line.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Small timing harness for the benchmark project.
+//
+// A benchmark is a callable taking a batch size n and performing n operations.
+// The harness first grows n until one batch takes at least min_sample_time, so
+// that clock overhead is negligible, then runs warmup batches that are thrown
+// away, then times samples batches. Each sample yields a time per operation;
+// the report gives their minimum, mean, percentiles and maximum.
+//
+// Results are logged as they complete and can also be written as JSON, so a
+// regression gate can compare runs.
+namespace bench
+{
+    // Keep the compiler from discarding a computed value.
+    template <typename T>
+    inline void do_not_optimize(const T& value)
+    {
+#if defined(_MSC_VER)
+        const volatile char* p = reinterpret_cast<const volatile char*>(&value);
+        (void)*p;
+#else
+        asm volatile("" : : "r,m"(value) : "memory");
+#endif
+    }
+
+    struct options
+    {
+        std::size_t warmup = 10;
+        std::size_t samples = 100;
+        std::chrono::nanoseconds min_sample_time = std::chrono::microseconds(200);
+
+        // Only benchmarks whose name contains this run.
+        std::string filter;
+
+        // Path of the JSON report; empty for none.
+        std::string json;
+    };
+
+    // Reads --warmup, --samples, --min-sample-us, --filter and --json.
+    inline options parse_options(const command_line& args)
+    {
+        options o;
+        o.warmup = args.get("warmup", o.warmup);
+        o.samples = std::max<std::size_t>(1, args.get("samples", o.samples));
+        o.min_sample_time = std::chrono::microseconds(args.get<std::int64_t>("min-sample-us",
+            std::chrono::duration_cast<std::chrono::microseconds>(o.min_sample_time).count()));
+        o.filter = args.get<std::string>("filter", "");
+        o.json = args.get<std::string>("json", "");
+        return o;
+    }
+
+    struct result
+    {
+        std::string name;
+        std::size_t batch = 0;
+        std::size_t samples = 0;
+
+        // Nanoseconds per operation.
+        double min = 0;
+        double mean = 0;
+        double p50 = 0;
+        double p90 = 0;
+        double p99 = 0;
+        double max = 0;
+
+        double ops_per_second() const
+        {
+            return p50 > 0 ? 1e9 / p50 : 0.0;
+        }
+    };
+
+    class runner
+    {
+    public:
+        explicit runner(options o)
+            : options_(std::move(o))
+        {
+        }
+
+        bool enabled(std::string_view name) const
+        {
+            return options_.filter.empty() || name.find(options_.filter) != std::string_view::npos;
+        }
+
+        // Time f(n), which must perform n operations.
+        template <typename F>
+        void run(std::string_view name, F&& f)
+        {
+            if (!enabled(name))
+                return;
+
+            // One untimed call first, so the calibration does not mistake
+            // cold caches and first-touch page faults for slow operations.
+            f(1);
+
+            std::size_t batch = 1;
+            while (time_batch(f, batch) < options_.min_sample_time && batch < (std::size_t(1) << 30))
+                batch *= 2;
+
+            for (std::size_t i = 0; i < options_.warmup; ++i)
+                time_batch(f, batch);
+
+            std::vector<double> per_op;
+            per_op.reserve(options_.samples);
+            for (std::size_t i = 0; i < options_.samples; ++i)
+                per_op.push_back(static_cast<double>(time_batch(f, batch).count()) / batch);
+
+            results_.push_back(summarize(std::string(name), batch, per_op));
+            const result& r = results_.back();
+            LOG_INFO("bench {:<40} p50={:>10.1f}ns p99={:>10.1f}ns min={:>10.1f}ns ops/s={:>12.0f} batch={}",
+                r.name, r.p50, r.p99, r.min, r.ops_per_second(), r.batch);
+        }
+
+        const std::vector<result>& results() const
+        {
+            return results_;
+        }
+
+        // Write the JSON report if one was asked for. Returns false if the
+        // file could not be written.
+        bool finish() const
+        {
+            if (options_.json.empty())
+                return true;
+
+            std::FILE* file = std::fopen(options_.json.c_str(), "w");
+            if (file == nullptr)
+            {
+                LOG_ERROR("bench: cannot write {}", options_.json);
+                return false;
+            }
+
+            fmt::print(file, "{{\n  \"benchmarks\": [");
+            for (std::size_t i = 0; i < results_.size(); ++i)
+            {
+                const result& r = results_[i];
+                fmt::print(file,
+                    "{}\n    {{ \"name\": \"{}\", \"batch\": {}, \"samples\": {}, \"ns_per_op\": "
+                    "{{ \"min\": {:.3f}, \"mean\": {:.3f}, \"p50\": {:.3f}, \"p90\": {:.3f}, \"p99\": {:.3f}, \"max\": {:.3f} }}, "
+                    "\"ops_per_second\": {:.1f} }}",
+                    i == 0 ? "" : ",", r.name, r.batch, r.samples, r.min, r.mean, r.p50, r.p90, r.p99, r.max, r.ops_per_second());
+            }
+            fmt::print(file, "\n  ]\n}}\n");
+            std::fclose(file);
+
+            LOG_INFO("bench: wrote {} results to {}", results_.size(), options_.json);
+            return true;
+        }
+
+    private:
+        template <typename F>
+        static std::chrono::nanoseconds time_batch(F& f, std::size_t n)
+        {
+            auto start = std::chrono::steady_clock::now();
+            f(n);
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        }
+
+        static result summarize(std::string name, std::size_t batch, std::vector<double>& per_op)
+        {
+            std::sort(per_op.begin(), per_op.end());
+            auto percentile = [&per_op](double p)
+            {
+                std::size_t index = static_cast<std::size_t>(p * (per_op.size() - 1) + 0.5);
+                return per_op[index];
+            };
+
+            result r;
+            r.name = std::move(name);
+            r.batch = batch;
+            r.samples = per_op.size();
+            r.min = per_op.front();
+            r.max = per_op.back();
+            double sum = 0;
+            for (double v : per_op)
+                sum += v;
+            r.mean = sum / per_op.size();
+            r.p50 = percentile(0.50);
+            r.p90 = percentile(0.90);
+            r.p99 = percentile(0.99);
+            return r;
+        }
+
+        options options_;
+        std::vector<result> results_;
+    };
+}
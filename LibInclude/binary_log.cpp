@@ -0,0 +1,191 @@
+#include <binary_log.h>
+
+#include <cstdio>
+#include <new>
+#include <unordered_map>
+
+namespace
+{
+    // What a binary log statement stores in the ring, followed by the
+    // encoded arguments.
+    struct message_record
+    {
+        spdlog::log_clock::time_point time;
+        const binary_log_site* site;
+        const char* format;
+        std::uint32_t format_size;
+        std::uint32_t arguments_size;
+        std::size_t thread_id;
+    };
+
+    std::int64_t nanoseconds_since_epoch(spdlog::log_clock::time_point time)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    }
+}
+
+//----------------------------------------------------------------------
+
+// Appends records to the file on the background thread of an
+// async_record_writer. Each statement's site record is written just before
+// its first message.
+class binary_log::writer
+    : public async_record_writer
+{
+public:
+    writer(std::FILE* file, async_log_options options)
+        : async_record_writer(options),
+        file_(file)
+    {
+        std::setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+        std::fwrite(binary_log_file::magic, 1, sizeof(binary_log_file::magic), file_);
+        start();
+    }
+
+    ~writer()
+    {
+        stop();
+        std::fclose(file_);
+    }
+
+    std::size_t max_arguments() const
+    {
+        return record_ring::max_record(options_.ring_bytes) - sizeof(message_record);
+    }
+
+    void submit(const binary_log_site& site, fmt::string_view format, std::size_t size,
+        encoder encode_arguments, const void* context)
+    {
+        message_record header{ spdlog::log_clock::now(), &site, format.data(),
+            static_cast<std::uint32_t>(format.size()), static_cast<std::uint32_t>(size),
+            spdlog::details::os::thread_id() };
+        push(local_ring(), sizeof(message_record) + size,
+            [&](void* p)
+            {
+                message_record* r = ::new (p) message_record(header);
+                encode_arguments(reinterpret_cast<char*>(r + 1), context);
+            });
+    }
+
+    using async_record_writer::flush_records;
+
+private:
+    // A site is a statement together with the format it was written with;
+    // oversized arguments write their statement's text with "{}" instead.
+    struct site_key
+    {
+        const binary_log_site* site;
+        const char* format;
+
+        bool operator==(const site_key& other) const
+        {
+            return site == other.site && format == other.format;
+        }
+    };
+
+    struct site_key_hash
+    {
+        std::size_t operator()(const site_key& key) const
+        {
+            return std::hash<const void*>()(key.site) * 31 + std::hash<const void*>()(key.format);
+        }
+    };
+
+    void write_record(const void* record) override
+    {
+        auto r = static_cast<const message_record*>(record);
+        std::uint32_t id = site_id(*r);
+
+        put(binary_log_file::message);
+        put(id);
+        put(nanoseconds_since_epoch(r->time));
+        put(static_cast<std::uint64_t>(r->thread_id));
+        put(r->arguments_size);
+        std::fwrite(r + 1, 1, r->arguments_size, file_);
+    }
+
+    void flush_output() override
+    {
+        std::fflush(file_);
+    }
+
+    void report_dropped(std::uint64_t count) override
+    {
+        put(binary_log_file::dropped);
+        put(nanoseconds_since_epoch(spdlog::log_clock::now()));
+        put(count);
+    }
+
+    std::uint32_t site_id(const message_record& r)
+    {
+        auto inserted = site_ids_.emplace(site_key{ r.site, r.format }, static_cast<std::uint32_t>(site_ids_.size()));
+        if (!inserted.second)
+            return inserted.first->second;
+
+        std::string_view file = r.site->file != nullptr ? r.site->file : "";
+        std::string_view function = r.site->function != nullptr ? r.site->function : "";
+        put(binary_log_file::site);
+        put(inserted.first->second);
+        put(static_cast<std::uint8_t>(r.site->level));
+        put(static_cast<std::uint32_t>(r.site->line));
+        put(static_cast<std::uint16_t>(file.size()));
+        put(static_cast<std::uint16_t>(function.size()));
+        put(r.format_size);
+        std::fwrite(file.data(), 1, file.size(), file_);
+        std::fwrite(function.data(), 1, function.size(), file_);
+        std::fwrite(r.format, 1, r.format_size, file_);
+        return inserted.first->second;
+    }
+
+    template <typename V>
+    void put(V value)
+    {
+        std::fwrite(&value, sizeof(value), 1, file_);
+    }
+
+    std::FILE* file_;
+    std::unordered_map<site_key, std::uint32_t, site_key_hash> site_ids_;
+};
+
+//----------------------------------------------------------------------
+
+bool binary_log::open(const std::string& path, async_log_options options)
+{
+    if (writer_.load(std::memory_order_acquire) != nullptr)
+        return false;
+
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+
+    writer* w = new writer(file, options);
+    max_arguments_ = w->max_arguments();
+    writer_.store(w, std::memory_order_release);
+    return true;
+}
+
+void binary_log::close()
+{
+    delete writer_.exchange(nullptr, std::memory_order_acq_rel);
+}
+
+void binary_log::flush()
+{
+    writer* w = writer_.load(std::memory_order_acquire);
+    if (w != nullptr)
+        w->flush_records();
+}
+
+void binary_log::submit(writer* w, const binary_log_site& site, fmt::string_view format, std::size_t size,
+    encoder encode_arguments, const void* context)
+{
+    w->submit(site, format, size, encode_arguments, context);
+}
+
+void binary_log::write_text(writer* w, const binary_log_site& site, std::string_view text)
+{
+    text = text.substr(0, max_arguments_ - encoded_size(std::string_view()));
+    w->submit(site, "{}", encoded_size(text),
+        [](char* p, const void* context) { encode(p, *static_cast<const std::string_view*>(context)); },
+        &text);
+}
@@ -0,0 +1,237 @@
+#pragma once
+#include <async_log.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Deferred-format binary logging.
+//
+// A binary log statement formats nothing. It records which statement ran, the
+// time, the thread and the raw bytes of its arguments into the thread's ring;
+// a background thread appends the records to a file, and the LogDecoder tool
+// formats them later. Strings are copied, numbers and pointers are stored as
+// they are, and the format string and source location are written to the
+// file once per statement.
+//
+// Building with LIBINCLUDE_BINARY_LOG defined routes the LOG_* macros here.
+// Until binary_log::open() is called, and after binary_log::close(), the
+// statements fall back to the spdlog default logger.
+//
+// File layout, integers in the byte order of the machine that wrote it:
+//
+//   file    := "LIBLOG01" record*
+//   record  := 'S' site | 'M' message | 'D' dropped
+//   site    := u32 id, u8 level, u32 line, u16 file size, u16 function size,
+//              u32 format size, file, function, format
+//   message := u32 site id, i64 time (ns since the epoch), u64 thread id,
+//              u32 arguments size, arguments
+//   dropped := i64 time, u64 count of messages lost to a full ring
+//   argument:= u8 binary_log_arg, value
+//
+// Values are 1 byte for boolean and character, 4 for float32, 8 for the
+// integers, float64 and pointer, and u32 size then bytes for string.
+
+// One static instance per log statement; its address identifies the statement.
+struct binary_log_site
+{
+    const char* file;
+    int line;
+    const char* function;
+    spdlog::level::level_enum level;
+};
+
+enum class binary_log_arg : std::uint8_t
+{
+    boolean = 'b',
+    character = 'c',
+    signed_integer = 'i',
+    unsigned_integer = 'u',
+    float32 = 'f',
+    float64 = 'd',
+    string = 's',
+    pointer = 'p'
+};
+
+namespace binary_log_file
+{
+    constexpr char magic[8] = { 'L', 'I', 'B', 'L', 'O', 'G', '0', '1' };
+    constexpr char site = 'S';
+    constexpr char message = 'M';
+    constexpr char dropped = 'D';
+}
+
+class binary_log
+{
+public:
+    // Start writing to path, replacing the file. Returns false if it cannot be
+    // created or a log is already open.
+    static bool open(const std::string& path, async_log_options options = async_log_options());
+
+    // Write everything out and close the file. No other thread may be logging.
+    static void close();
+
+    // Wait until everything logged before the call is in the file.
+    static void flush();
+
+    static bool is_open()
+    {
+        return writer_.load(std::memory_order_acquire) != nullptr;
+    }
+
+    template <typename... Args>
+    static void write(const binary_log_site& site, fmt::format_string<Args...> format, Args&&... args)
+    {
+        writer* w = writer_.load(std::memory_order_acquire);
+        if (w == nullptr)
+        {
+            spdlog::default_logger_raw()->log(spdlog::source_loc{ site.file, site.line, site.function }, site.level,
+                format, std::forward<Args>(args)...);
+            return;
+        }
+
+        // Arguments too big for the ring are formatted here instead, and the
+        // text is stored, truncated, as a single string.
+        std::size_t size = (std::size_t(0) + ... + encoded_size(args));
+        if (size > max_arguments_)
+        {
+            write_text(w, site, fmt::format(format, std::forward<Args>(args)...));
+            return;
+        }
+
+        auto values = std::forward_as_tuple(args...);
+        using values_type = decltype(values);
+        submit(w, site, fmt::string_view(format), size,
+            [](char* p, const void* context)
+            {
+                std::apply([&p](const auto&... value) { ((p = encode(p, value)), ...); },
+                    *static_cast<const values_type*>(context));
+            },
+            &values);
+    }
+
+    // A statement with a single argument and no format string, as in
+    // LOG_ERROR(e.what()).
+    template <typename T>
+    static void write(const binary_log_site& site, const T& message)
+    {
+        if constexpr (std::is_convertible_v<const T&, std::string_view>)
+        {
+            writer* w = writer_.load(std::memory_order_acquire);
+            if (w == nullptr)
+                spdlog::default_logger_raw()->log(spdlog::source_loc{ site.file, site.line, site.function }, site.level, message);
+            else
+                write_text(w, site, as_string(message));
+        }
+        else
+        {
+            write(site, "{}", message);
+        }
+    }
+
+private:
+    class writer;
+
+    // Fills the arguments of one record in place.
+    typedef void (*encoder)(char* destination, const void* context);
+
+    static void submit(writer* w, const binary_log_site& site, fmt::string_view format, std::size_t size,
+        encoder encode_arguments, const void* context);
+    static void write_text(writer* w, const binary_log_site& site, std::string_view text);
+
+    template <typename T>
+    static constexpr binary_log_arg arg_type()
+    {
+        using U = std::remove_cvref_t<T>;
+        if constexpr (std::is_same_v<U, bool>)
+            return binary_log_arg::boolean;
+        else if constexpr (std::is_same_v<U, char>)
+            return binary_log_arg::character;
+        else if constexpr (std::is_enum_v<U>)
+            return arg_type<std::underlying_type_t<U>>();
+        else if constexpr (std::is_integral_v<U>)
+            return std::is_signed_v<U> ? binary_log_arg::signed_integer : binary_log_arg::unsigned_integer;
+        else if constexpr (std::is_same_v<U, float>)
+            return binary_log_arg::float32;
+        else if constexpr (std::is_floating_point_v<U>)
+            return binary_log_arg::float64;
+        else if constexpr (std::is_convertible_v<const U&, std::string_view>)
+            return binary_log_arg::string;
+        else if constexpr (std::is_pointer_v<U> || std::is_null_pointer_v<U>)
+            return binary_log_arg::pointer;
+        else
+            static_assert(sizeof(U) == 0, "binary logging records arithmetic, string and pointer arguments only");
+    }
+
+    template <typename T>
+    static std::string_view as_string(const T& value)
+    {
+        if constexpr (std::is_pointer_v<T>)
+        {
+            if (value == nullptr)
+                return std::string_view();
+        }
+        return std::string_view(value);
+    }
+
+    template <typename T>
+    static std::size_t encoded_size(const T& value)
+    {
+        constexpr binary_log_arg type = arg_type<T>();
+        if constexpr (type == binary_log_arg::boolean || type == binary_log_arg::character)
+            return 2;
+        else if constexpr (type == binary_log_arg::float32)
+            return 1 + sizeof(float);
+        else if constexpr (type == binary_log_arg::string)
+            return 1 + sizeof(std::uint32_t) + as_string(value).size();
+        else
+            return 1 + sizeof(std::uint64_t);
+    }
+
+    template <typename V>
+    static char* put(char* p, V value)
+    {
+        std::memcpy(p, &value, sizeof(value));
+        return p + sizeof(value);
+    }
+
+    template <typename T>
+    static char* encode(char* p, const T& value)
+    {
+        constexpr binary_log_arg type = arg_type<T>();
+        *p++ = static_cast<char>(type);
+        if constexpr (type == binary_log_arg::boolean)
+            return put<std::uint8_t>(p, value ? 1 : 0);
+        else if constexpr (type == binary_log_arg::character)
+            return put<char>(p, value);
+        else if constexpr (type == binary_log_arg::signed_integer)
+            return put<std::int64_t>(p, static_cast<std::int64_t>(value));
+        else if constexpr (type == binary_log_arg::unsigned_integer)
+            return put<std::uint64_t>(p, static_cast<std::uint64_t>(value));
+        else if constexpr (type == binary_log_arg::float32)
+            return put<float>(p, value);
+        else if constexpr (type == binary_log_arg::float64)
+            return put<double>(p, static_cast<double>(value));
+        else if constexpr (type == binary_log_arg::string)
+        {
+            std::string_view s = as_string(value);
+            p = put<std::uint32_t>(p, static_cast<std::uint32_t>(s.size()));
+            if (!s.empty())
+                std::memcpy(p, s.data(), s.size());
+            return p + s.size();
+        }
+        else
+            return put<std::uint64_t>(p, static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(value)));
+    }
+
+    static inline std::atomic<writer*> writer_{ nullptr };
+
+    // The largest arguments a record can hold; set before writer_.
+    static inline std::size_t max_arguments_ = 0;
+};
@@ -0,0 +1,131 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <asio/buffer.hpp>
+
+// Fixed-capacity ring of bytes used as a read-ahead buffer. prepare() exposes
+// the free space as up to two mutable buffers, so one async_read_some can fill
+// the ring across its wrap point; the filled bytes are then inspected with
+// peek() or data() and released with consume().
+//
+// The ring is not synchronised; it belongs to a single session.
+class byte_ring
+{
+public:
+    // The capacity is rounded up to the next power of two.
+    explicit byte_ring(std::size_t capacity)
+        : capacity_(round_up(capacity)),
+        storage_(new char[capacity_]),
+        head_(0),
+        tail_(0)
+    {
+    }
+
+    byte_ring(const byte_ring&) = delete;
+    byte_ring& operator=(const byte_ring&) = delete;
+
+    std::size_t capacity() const
+    {
+        return capacity_;
+    }
+
+    // Number of bytes committed but not yet consumed.
+    std::size_t size() const
+    {
+        return tail_ - head_;
+    }
+
+    std::size_t space() const
+    {
+        return capacity_ - size();
+    }
+
+    bool empty() const
+    {
+        return head_ == tail_;
+    }
+
+    bool full() const
+    {
+        return size() == capacity_;
+    }
+
+    // The free space, in order. The second buffer is empty unless the free
+    // space wraps around the end of the storage.
+    std::array<asio::mutable_buffer, 2> prepare()
+    {
+        std::size_t start = offset(tail_);
+        std::size_t first = std::min(space(), capacity_ - start);
+        return { {
+            asio::mutable_buffer(storage_.get() + start, first),
+            asio::mutable_buffer(storage_.get(), space() - first) } };
+    }
+
+    // The filled bytes, in order. The second buffer is empty unless they wrap
+    // around the end of the storage. Suitable for a gathered write.
+    std::array<asio::const_buffer, 2> data() const
+    {
+        std::size_t start = offset(head_);
+        std::size_t first = std::min(size(), capacity_ - start);
+        return { {
+            asio::const_buffer(storage_.get() + start, first),
+            asio::const_buffer(storage_.get(), size() - first) } };
+    }
+
+    // Mark n bytes of the space returned by prepare() as filled.
+    void commit(std::size_t n)
+    {
+        tail_ += n;
+    }
+
+    // Copy n bytes starting offset bytes past the read position, without
+    // consuming them. The caller guarantees offset + n <= size().
+    void peek(void* destination, std::size_t n, std::size_t offset_bytes = 0) const
+    {
+        std::size_t start = offset(head_ + offset_bytes);
+        std::size_t first = std::min(n, capacity_ - start);
+        std::memcpy(destination, storage_.get() + start, first);
+        std::memcpy(static_cast<char*>(destination) + first, storage_.get(), n - first);
+    }
+
+    void consume(std::size_t n)
+    {
+        head_ += n;
+
+        // Rewinding an empty ring keeps the next read contiguous.
+        if (head_ == tail_)
+            head_ = tail_ = 0;
+    }
+
+    // Like consume(), but never rewinds. Buffers from an earlier prepare()
+    // that a read is still filling stay valid, so a writer can drain the ring
+    // while a read into it is in flight.
+    void consume_no_rewind(std::size_t n)
+    {
+        head_ += n;
+    }
+
+private:
+    static std::size_t round_up(std::size_t n)
+    {
+        std::size_t capacity = 1;
+        while (capacity < n)
+            capacity <<= 1;
+        return capacity;
+    }
+
+    std::size_t offset(std::size_t position) const
+    {
+        return position & (capacity_ - 1);
+    }
+
+    std::size_t capacity_;
+    std::unique_ptr<char[]> storage_;
+
+    // Free-running read and write positions; offset() maps them into storage_.
+    std::size_t head_;
+    std::size_t tail_;
+};
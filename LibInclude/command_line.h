@@ -0,0 +1,97 @@
+#pragma once
+#include <charconv>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Minimal "--name=value" argument reader shared by the samples. Arguments that
+// do not start with "--" are kept as positional values in their original order.
+// A bare "--name" is treated as a flag and reads back as true.
+class command_line
+{
+public:
+    command_line(int argc, char* argv[])
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string_view arg(argv[i]);
+            if (arg.substr(0, 2) != "--")
+            {
+                positional_.emplace_back(arg);
+                continue;
+            }
+
+            arg.remove_prefix(2);
+            auto equal = arg.find('=');
+            if (equal == std::string_view::npos)
+                named_.push_back({ std::string(arg), std::string(), false });
+            else
+                named_.push_back({ std::string(arg.substr(0, equal)), std::string(arg.substr(equal + 1)), true });
+        }
+    }
+
+    bool has(std::string_view name) const
+    {
+        return find(name) != nullptr;
+    }
+
+    std::size_t positional_count() const
+    {
+        return positional_.size();
+    }
+
+    const std::string& positional(std::size_t index) const
+    {
+        return positional_[index];
+    }
+
+    template <typename T>
+    T get(std::string_view name, T default_value) const
+    {
+        const entry* e = find(name);
+        if (e == nullptr)
+            return default_value;
+
+        if constexpr (std::is_same_v<T, bool>)
+        {
+            return !e->has_value || e->value == "1" || e->value == "true" || e->value == "on";
+        }
+        else if constexpr (std::is_same_v<T, std::string>)
+        {
+            return e->value;
+        }
+        else
+        {
+            static_assert(std::is_arithmetic_v<T>, "command_line::get supports bool, std::string and arithmetic types");
+            T value = default_value;
+            auto result = std::from_chars(e->value.data(), e->value.data() + e->value.size(), value);
+            if (result.ec != std::errc() || result.ptr != e->value.data() + e->value.size())
+                return default_value;
+            return value;
+        }
+    }
+
+private:
+    struct entry
+    {
+        std::string name;
+        std::string value;
+        bool has_value;
+    };
+
+    const entry* find(std::string_view name) const
+    {
+        // Later arguments override earlier ones.
+        for (auto it = named_.rbegin(); it != named_.rend(); ++it)
+        {
+            if (it->name == name)
+                return &*it;
+        }
+        return nullptr;
+    }
+
+    std::vector<entry> named_;
+    std::vector<std::string> positional_;
+};
@@ -0,0 +1,29 @@
+#pragma once
+#include <asio/detail/config.hpp>
+
+// The mechanism asio's io_context waits for socket readiness or completions
+// with in this build.
+//
+// On Linux that is epoll unless asio is built with ASIO_HAS_IO_URING and
+// ASIO_DISABLE_EPOLL, and linked with liburing: every socket, descriptor and
+// timer operation then goes through an io_uring submission queue instead of
+// a readiness notification followed by a non-blocking read or write. With
+// ASIO_HAS_IO_URING alone, io_uring is only used for files and epoll stays the
+// socket backend. Only the epoll build of the samples has been run; the
+// io_uring name is what asio's configuration selects with both defined.
+inline const char* io_backend_name()
+{
+#if defined(ASIO_HAS_IOCP)
+    return "iocp";
+#elif defined(ASIO_HAS_IO_URING_AS_DEFAULT)
+    return "io_uring";
+#elif defined(ASIO_HAS_EPOLL)
+    return "epoll";
+#elif defined(ASIO_HAS_KQUEUE)
+    return "kqueue";
+#elif defined(ASIO_HAS_DEV_POLL)
+    return "dev_poll";
+#else
+    return "select";
+#endif
+}
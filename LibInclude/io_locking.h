@@ -0,0 +1,219 @@
+#pragma once
+#include <lockfree_strand.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <asio/buffer.hpp>
+#include <asio/io_context.hpp>
+#include <asio/post.hpp>
+
+#if !defined(ASIO_HAS_IOCP)
+#include <asio/posix/stream_descriptor.hpp>
+#include <unistd.h>
+#endif
+
+// How much an io_context run by a single thread locks internally, chosen
+// through its concurrency hint when it is constructed.
+//
+// A server sharded one io_context per thread never shares a shard's sockets
+// or timers between threads, so the locks asio takes to protect them are pure
+// overhead. The unsafe modes drop them. Construct an io_context's objects
+// before its thread starts, or on that thread; cross-shard work then goes
+// through an io_mailbox, which is safe in every mode.
+//
+// Windows' I/O completion ports ignore the locking flags, so there every mode
+// behaves, and is reported, as safe.
+enum class io_locking
+{
+    // Every lock kept: other threads may post to the io_context and use its
+    // objects.
+    safe,
+
+    // ASIO_CONCURRENCY_HINT_UNSAFE_IO: the reactor does not lock, so only the
+    // io_context's thread may create, use or destroy its sockets, descriptors
+    // and timers. The scheduler still locks, so asio::post from any thread
+    // remains safe.
+    unsafe_io,
+
+    // ASIO_CONCURRENCY_HINT_UNSAFE: nothing locks. Only the io_context's
+    // thread may touch it, asio::post and stop() included. Asynchronous name
+    // resolution fails with operation_not_supported, and no other io_context
+    // may use signal_set.
+    unsafe
+};
+
+// The mode an io_context constructed for locking really runs in here.
+inline io_locking effective_io_locking(io_locking locking)
+{
+#if defined(ASIO_HAS_IOCP)
+    (void)locking;
+    return io_locking::safe;
+#else
+    return locking;
+#endif
+}
+
+// The concurrency hint for an io_context run by one thread with locking.
+inline int concurrency_hint(io_locking locking)
+{
+    switch (effective_io_locking(locking))
+    {
+    case io_locking::unsafe_io:
+        return ASIO_CONCURRENCY_HINT_UNSAFE_IO;
+    case io_locking::unsafe:
+        return ASIO_CONCURRENCY_HINT_UNSAFE;
+    case io_locking::safe:
+        break;
+    }
+    return 1;
+}
+
+inline const char* io_locking_name(io_locking locking)
+{
+    switch (locking)
+    {
+    case io_locking::unsafe_io:
+        return "unsafe_io";
+    case io_locking::unsafe:
+        return "unsafe";
+    case io_locking::safe:
+        break;
+    }
+    return "safe";
+}
+
+// Parses "safe", "unsafe_io" or "unsafe"; returns false for anything else.
+inline bool parse_io_locking(std::string_view name, io_locking& locking)
+{
+    for (io_locking candidate : { io_locking::safe, io_locking::unsafe_io, io_locking::unsafe })
+    {
+        if (name == io_locking_name(candidate))
+        {
+            locking = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs functions posted from any thread on an io_context's thread, whatever
+// its io_locking mode.
+//
+// Posting is a lock-free push, as onto a lockfree_strand. Only the first
+// function posted while the mailbox is idle wakes the io_context: through
+// asio::post where its scheduler locks, and otherwise by writing a byte to a
+// pipe whose read end the io_context waits on. The functions run in the order
+// posted, up to max_batch per handler.
+//
+// Construct the mailbox on the io_context's thread, or before that thread
+// starts, and destroy it only once the io_context will not run again. In
+// unsafe mode the wait on the pipe keeps the io_context's run() from
+// returning.
+class io_mailbox
+{
+public:
+    static constexpr std::size_t max_batch = 64;
+
+    io_mailbox(asio::io_context& io_context, io_locking locking)
+        : io_context_(io_context),
+        locking_(effective_io_locking(locking))
+#if !defined(ASIO_HAS_IOCP)
+        , wake_read_(io_context),
+        wake_write_(io_context)
+#endif
+    {
+#if !defined(ASIO_HAS_IOCP)
+        if (locking_ == io_locking::unsafe)
+        {
+            int pipe[2];
+            if (::pipe(pipe) != 0)
+                asio::detail::throw_error(std::error_code(errno, asio::error::get_system_category()), "pipe");
+            wake_read_.assign(pipe[0]);
+            wake_write_.assign(pipe[1]);
+            wake_read_.non_blocking(true);
+            wait();
+        }
+#endif
+    }
+
+    io_mailbox(const io_mailbox&) = delete;
+    io_mailbox& operator=(const io_mailbox&) = delete;
+
+    // Any thread.
+    template <typename F>
+    void post(F&& f)
+    {
+        if (state_.push(std::forward<F>(f)))
+            wake();
+    }
+
+private:
+    void wake()
+    {
+#if !defined(ASIO_HAS_IOCP)
+        if (locking_ == io_locking::unsafe)
+        {
+            // A plain write, which leaves the reactor's state to the
+            // io_context's thread.
+            char byte = 0;
+            while (::write(wake_write_.native_handle(), &byte, 1) < 0 && errno == EINTR)
+            {
+            }
+            return;
+        }
+#endif
+        asio::post(io_context_, [this]() { run(); });
+    }
+
+#if !defined(ASIO_HAS_IOCP)
+    void wait()
+    {
+        wake_read_.async_wait(asio::posix::stream_descriptor::wait_read,
+            [this](std::error_code ec)
+            {
+                if (ec)
+                    return;
+
+                char bytes[64];
+                std::error_code drained;
+                while (wake_read_.read_some(asio::buffer(bytes), drained) == sizeof(bytes))
+                {
+                }
+
+                wait();
+                run();
+            });
+    }
+#endif
+
+    void run()
+    {
+        // Account for what ran, and post the rest to this thread, even when
+        // a function throws.
+        struct finish_run
+        {
+            io_mailbox& mailbox;
+            std::size_t ran;
+
+            ~finish_run()
+            {
+                if (mailbox.state_.finish(ran))
+                    asio::post(mailbox.io_context_, [&mailbox = mailbox]() { mailbox.run(); });
+            }
+        } finish{ *this, 0 };
+
+        state_.run(max_batch, finish.ran);
+    }
+
+    asio::io_context& io_context_;
+    io_locking locking_;
+    lockfree_strand_state state_;
+
+#if !defined(ASIO_HAS_IOCP)
+    asio::posix::stream_descriptor wake_read_;
+    asio::posix::stream_descriptor wake_write_;
+#endif
+};
@@ -0,0 +1,99 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+// Fixed-size log-linear histogram of durations in nanoseconds. Every power of
+// two is split into 32 linear sub-buckets, so a reported percentile is within
+// about 3% of the true value, and recording is a few shifts and an increment.
+// Histograms recorded on different threads are combined with merge().
+//
+// Not synchronised; give each thread its own.
+class latency_histogram
+{
+public:
+    latency_histogram()
+        : counts_{},
+        count_(0),
+        max_(0)
+    {
+    }
+
+    void record(std::uint64_t ns)
+    {
+        ++counts_[index(ns)];
+        ++count_;
+        max_ = std::max(max_, ns);
+    }
+
+    void merge(const latency_histogram& other)
+    {
+        for (std::size_t i = 0; i < bucket_count; ++i)
+            counts_[i] += other.counts_[i];
+        count_ += other.count_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    std::uint64_t count() const
+    {
+        return count_;
+    }
+
+    std::uint64_t max() const
+    {
+        return max_;
+    }
+
+    // The value below which a fraction q (0..1) of the recorded values fall,
+    // reported as the upper edge of its bucket.
+    std::uint64_t percentile(double q) const
+    {
+        if (count_ == 0)
+            return 0;
+
+        std::uint64_t rank = static_cast<std::uint64_t>(q * count_);
+        if (rank >= count_)
+            rank = count_ - 1;
+
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; ++i)
+        {
+            seen += counts_[i];
+            if (seen > rank)
+                return std::min(upper_edge(i), max_);
+        }
+        return max_;
+    }
+
+private:
+    static constexpr unsigned sub_bucket_bits = 5;
+    static constexpr std::uint64_t sub_buckets = std::uint64_t(1) << sub_bucket_bits;
+    static constexpr std::size_t bucket_count = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+    // Values below sub_buckets map to themselves; above that, the bucket is
+    // chosen by the position of the top bit and the sub_bucket_bits below it.
+    static std::size_t index(std::uint64_t v)
+    {
+        if (v < sub_buckets)
+            return static_cast<std::size_t>(v);
+
+        unsigned shift = static_cast<unsigned>(std::bit_width(v)) - 1 - sub_bucket_bits;
+        return static_cast<std::size_t>((shift + 1) * sub_buckets + ((v >> shift) & (sub_buckets - 1)));
+    }
+
+    static std::uint64_t upper_edge(std::size_t i)
+    {
+        if (i < sub_buckets)
+            return i;
+
+        unsigned shift = static_cast<unsigned>(i / sub_buckets) - 1;
+        std::uint64_t low = (sub_buckets + i % sub_buckets) << shift;
+        return low + ((std::uint64_t(1) << shift) - 1);
+    }
+
+    std::array<std::uint64_t, bucket_count> counts_;
+    std::uint64_t count_;
+    std::uint64_t max_;
+};
@@ -0,0 +1,303 @@
+#pragma once
+#include <mpsc_queue.h>
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <asio/execution.hpp>
+#include <asio/execution_context.hpp>
+#include <asio/is_executor.hpp>
+#include <asio/prefer.hpp>
+#include <asio/query.hpp>
+#include <asio/recycling_allocator.hpp>
+#include <asio/require.hpp>
+
+// void() callable queued by a lockfree_strand, constructed in its queue node
+// and never moved. Callables of up to inline_size bytes are stored in place,
+// so queueing one costs only the node.
+class strand_function
+{
+public:
+    static constexpr std::size_t inline_size = 64;
+
+    template <typename F>
+    explicit strand_function(F&& f)
+    {
+        typedef std::decay_t<F> function_type;
+        if constexpr (sizeof(function_type) <= inline_size && alignof(function_type) <= alignof(std::max_align_t))
+        {
+            ::new (static_cast<void*>(storage_)) function_type(std::forward<F>(f));
+            operations_ = &inline_operations<function_type>;
+        }
+        else
+        {
+            ::new (static_cast<void*>(storage_)) function_type*(new function_type(std::forward<F>(f)));
+            operations_ = &heap_operations<function_type>;
+        }
+    }
+
+    ~strand_function()
+    {
+        operations_->destroy(storage_);
+    }
+
+    strand_function(const strand_function&) = delete;
+    strand_function& operator=(const strand_function&) = delete;
+
+    void operator()()
+    {
+        operations_->invoke(storage_);
+    }
+
+private:
+    struct operations
+    {
+        void (*invoke)(void* storage);
+        void (*destroy)(void* storage);
+    };
+
+    template <typename F>
+    static constexpr operations inline_operations{
+        [](void* storage) { (*static_cast<F*>(storage))(); },
+        [](void* storage) { static_cast<F*>(storage)->~F(); }
+    };
+
+    // storage_ holds a pointer to the callable.
+    template <typename F>
+    static constexpr operations heap_operations{
+        [](void* storage) { (**static_cast<F**>(storage))(); },
+        [](void* storage) { delete *static_cast<F**>(storage); }
+    };
+
+    alignas(std::max_align_t) unsigned char storage_[inline_size];
+    const operations* operations_;
+};
+
+// The shared state of a lockfree_strand and its copies: the queue of handlers
+// and a count of those not yet run. Whoever raises the count from zero owns
+// the strand and schedules a run of it; a run gives it up only when the count
+// drops back to zero.
+class lockfree_strand_state
+{
+public:
+    lockfree_strand_state()
+        : pending_(0)
+    {
+    }
+
+    lockfree_strand_state(const lockfree_strand_state&) = delete;
+    lockfree_strand_state& operator=(const lockfree_strand_state&) = delete;
+
+    // Any thread. Returns true if the strand was idle, in which case the
+    // caller must schedule a run.
+    template <typename F>
+    bool push(F&& f)
+    {
+        queue_.emplace(std::forward<F>(f));
+        return pending_.fetch_add(1, std::memory_order_acq_rel) == 0;
+    }
+
+    // From a scheduled run only. Runs up to max handlers, counting each in
+    // ran before it is called.
+    void run(std::size_t max, std::size_t& ran)
+    {
+        struct mark_running
+        {
+            const lockfree_strand_state* previous;
+
+            ~mark_running()
+            {
+                current_ = previous;
+            }
+        } mark{ std::exchange(current_, this) };
+
+        queue_.consume(max,
+            [&ran](strand_function&& f)
+            {
+                ++ran;
+                f();
+            });
+    }
+
+    // From a scheduled run only, after run(). Returns true if handlers remain,
+    // in which case the caller must schedule another run. Some may not be
+    // visible yet, if their producers are still inside push().
+    bool finish(std::size_t ran)
+    {
+        return pending_.fetch_sub(ran, std::memory_order_acq_rel) != ran;
+    }
+
+    bool running_in_this_thread() const
+    {
+        return current_ == this;
+    }
+
+private:
+    static inline thread_local const lockfree_strand_state* current_ = nullptr;
+
+    mpsc_queue<strand_function, asio::recycling_allocator<strand_function>> queue_;
+
+    // Producers and the running thread both touch the count; keep it off the
+    // queue's lines.
+    alignas(64) std::atomic<std::size_t> pending_;
+};
+
+// Drop-in alternative to asio::strand<Executor>.
+//
+// asio's strands all share the 193 mutexes of strand_executor_service, chosen
+// by hash, so unrelated strands can contend for the same mutex and every post
+// takes one. Here each strand owns its queue: posting is a wait-free push and
+// one atomic increment, and a run takes handlers off the queue without a lock.
+// A run is scheduled on the inner executor when the strand goes from idle to
+// busy, and runs at most max_batch handlers before rescheduling itself so that
+// a busy strand does not monopolise a thread.
+//
+// Handlers are run in the order they were posted and never concurrently. As
+// with asio::strand, a handler dispatched from inside the strand's own run
+// runs at once. Create one with make_lockfree_strand.
+template <typename Executor>
+class lockfree_strand
+{
+public:
+    typedef Executor inner_executor_type;
+
+    static constexpr std::size_t max_batch = 64;
+
+    template <typename Executor1>
+        requires (!std::is_same_v<Executor1, lockfree_strand> && std::is_convertible_v<const Executor1&, Executor>)
+    explicit lockfree_strand(const Executor1& executor)
+        : executor_(executor),
+        state_(std::make_shared<lockfree_strand_state>())
+    {
+    }
+
+    inner_executor_type get_inner_executor() const noexcept
+    {
+        return executor_;
+    }
+
+    bool running_in_this_thread() const noexcept
+    {
+        return state_->running_in_this_thread();
+    }
+
+    // Properties are those of the inner executor, except that the strand may
+    // block where the inner executor always would.
+    template <typename Property>
+        requires asio::can_query<const Executor&, Property>::value
+    decltype(auto) query(const Property& property) const
+    {
+        if constexpr (std::is_convertible_v<Property, asio::execution::blocking_t>)
+        {
+            asio::execution::blocking_t blocking = asio::query(executor_, property);
+            return blocking == asio::execution::blocking.always
+                ? asio::execution::blocking_t(asio::execution::blocking.possibly) : blocking;
+        }
+        else
+        {
+            return asio::query(executor_, property);
+        }
+    }
+
+    template <typename Property>
+        requires (asio::can_require<const Executor&, Property>::value
+            && !std::is_convertible_v<Property, asio::execution::blocking_t::always_t>)
+    auto require(const Property& property) const
+    {
+        typedef std::decay_t<decltype(asio::require(executor_, property))> executor_type;
+        return lockfree_strand<executor_type>(asio::require(executor_, property), state_);
+    }
+
+    template <typename Property>
+        requires (asio::can_prefer<const Executor&, Property>::value
+            && !std::is_convertible_v<Property, asio::execution::blocking_t::always_t>)
+    auto prefer(const Property& property) const
+    {
+        typedef std::decay_t<decltype(asio::prefer(executor_, property))> executor_type;
+        return lockfree_strand<executor_type>(asio::prefer(executor_, property), state_);
+    }
+
+    template <typename Function>
+    void execute(Function&& f) const
+    {
+        if constexpr (asio::can_query<const Executor&, asio::execution::blocking_t>::value)
+        {
+            if (asio::query(executor_, asio::execution::blocking) != asio::execution::blocking.never
+                && state_->running_in_this_thread())
+            {
+                std::decay_t<Function> local(std::forward<Function>(f));
+                local();
+                return;
+            }
+        }
+
+        if (state_->push(std::forward<Function>(f)))
+            schedule(state_, executor_);
+    }
+
+    friend bool operator==(const lockfree_strand& a, const lockfree_strand& b) noexcept
+    {
+        return a.state_ == b.state_;
+    }
+
+    friend bool operator!=(const lockfree_strand& a, const lockfree_strand& b) noexcept
+    {
+        return a.state_ != b.state_;
+    }
+
+private:
+    template <typename>
+    friend class lockfree_strand;
+
+    lockfree_strand(const Executor& executor, std::shared_ptr<lockfree_strand_state> state)
+        : executor_(executor),
+        state_(std::move(state))
+    {
+    }
+
+    static void schedule(std::shared_ptr<lockfree_strand_state> state, const Executor& executor)
+    {
+        asio::execution::execute(asio::require(executor, asio::execution::blocking.never),
+            [state = std::move(state), executor]() { run(state, executor); });
+    }
+
+    static void run(const std::shared_ptr<lockfree_strand_state>& state, const Executor& executor)
+    {
+        // Account for what ran, and hand the rest to another run, even when a
+        // handler throws.
+        struct finish_run
+        {
+            const std::shared_ptr<lockfree_strand_state>& state;
+            const Executor& executor;
+            std::size_t ran;
+
+            ~finish_run()
+            {
+                if (state->finish(ran))
+                    schedule(state, executor);
+            }
+        } finish{ state, executor, 0 };
+
+        state->run(max_batch, finish.ran);
+    }
+
+    Executor executor_;
+    std::shared_ptr<lockfree_strand_state> state_;
+};
+
+template <typename Executor>
+    requires (asio::execution::is_executor<Executor>::value || asio::is_executor<Executor>::value)
+inline lockfree_strand<Executor> make_lockfree_strand(const Executor& executor)
+{
+    return lockfree_strand<Executor>(executor);
+}
+
+template <typename ExecutionContext>
+    requires std::is_convertible_v<ExecutionContext&, asio::execution_context&>
+inline lockfree_strand<typename ExecutionContext::executor_type> make_lockfree_strand(ExecutionContext& context)
+{
+    return lockfree_strand<typename ExecutionContext::executor_type>(context.get_executor());
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Call-site state of the sampled and rate-limited LOG_* macros.
+//
+// Each LOG_*_EVERY_N and LOG_*_RATE statement owns one static instance, shared
+// by every thread that runs the statement. Deciding costs a few atomic
+// operations and no lock, so a suppressed statement stays cheap in a hot
+// handler. When a statement logs again, allow() reports how many calls were
+// suppressed since it last logged, and the macros log that count first.
+
+// Lets through the first of every n calls.
+class log_every_n
+{
+public:
+    constexpr log_every_n()
+        : calls_(0)
+    {
+    }
+
+    log_every_n(const log_every_n&) = delete;
+    log_every_n& operator=(const log_every_n&) = delete;
+
+    bool allow(std::uint64_t n, std::uint64_t& suppressed)
+    {
+        std::uint64_t call = calls_.fetch_add(1, std::memory_order_relaxed);
+        if (n > 1 && call % n != 0)
+            return false;
+
+        suppressed = call == 0 || n <= 1 ? 0 : n - 1;
+        return true;
+    }
+
+private:
+    std::atomic<std::uint64_t> calls_;
+};
+
+// Token bucket holding one second of tokens, refilled at per_second tokens a
+// second.
+//
+// The bucket is kept as a single timestamp, the time at which it would be
+// full again (the generic cell rate algorithm). A call is allowed while that
+// time is less than a second ahead of now, and pushes it on by one token's
+// worth; a suppressed call only reads it.
+class log_rate_limit
+{
+public:
+    constexpr log_rate_limit()
+        : full_at_(0),
+        suppressed_(0)
+    {
+    }
+
+    log_rate_limit(const log_rate_limit&) = delete;
+    log_rate_limit& operator=(const log_rate_limit&) = delete;
+
+    bool allow(std::uint64_t per_second, std::uint64_t& suppressed)
+    {
+        constexpr std::int64_t second = std::chrono::nanoseconds(std::chrono::seconds(1)).count();
+        std::int64_t interval = second / static_cast<std::int64_t>(per_second > 0 ? per_second : 1);
+        std::int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+
+        std::int64_t full_at = full_at_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            if (full_at - now > second - interval)
+            {
+                suppressed_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            std::int64_t next = (full_at > now ? full_at : now) + interval;
+            if (full_at_.compare_exchange_weak(full_at, next, std::memory_order_relaxed))
+                break;
+        }
+
+        suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    std::atomic<std::int64_t> full_at_;
+    std::atomic<std::uint64_t> suppressed_;
+};
@@ -0,0 +1,241 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Unbounded multi-producer single-consumer queue (Vyukov's intrusive list
+// algorithm). push() is wait-free: one atomic exchange and one store. Only one
+// thread at a time may consume.
+//
+// A consumer can briefly see the queue as empty while a producer is between
+// its two steps; the producer's item becomes visible when the push completes.
+// Callers that post a wake-up on the empty -> non-empty transition (see
+// chat_client::write) must therefore make the producer, not the consumer,
+// decide whether a wake-up is needed.
+//
+// Nodes are allocated by the producers and freed by the consumer, so an
+// allocator with per-thread caches keeps draining on one side and spilling
+// on the other. A node cache hands them back directly instead: the consumer
+// parks freed nodes in a bounded ring with a store and producers take them
+// from it with one compare-exchange, neither side taking a lock. Nodes that
+// do not fit in the ring, or that producers need while it is empty, go
+// through the allocator.
+template <typename T, typename Allocator = std::allocator<T>>
+class mpsc_queue
+{
+public:
+    explicit mpsc_queue(const Allocator& allocator = Allocator())
+        : mpsc_queue(0, allocator)
+    {
+    }
+
+    // Recycle up to node_cache nodes, rounded up to a power of two.
+    explicit mpsc_queue(std::size_t node_cache, const Allocator& allocator = Allocator())
+        : allocator_(allocator),
+        cache_(node_cache),
+        head_(&stub_),
+        tail_(&stub_)
+    {
+    }
+
+    mpsc_queue(const mpsc_queue&) = delete;
+    mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+    ~mpsc_queue()
+    {
+        consume_all([](T&&) {});
+        release(tail_);
+
+        while (node* n = cache_.pop())
+            std::allocator_traits<node_allocator>::deallocate(allocator_, n, 1);
+    }
+
+    // Any thread.
+    void push(T value)
+    {
+        emplace(std::move(value));
+    }
+
+    // Any thread. Constructs the item in its node.
+    template <typename... Args>
+    void emplace(Args&&... args)
+    {
+        node* n = cache_.pop();
+        if (n == nullptr)
+            n = std::allocator_traits<node_allocator>::allocate(allocator_, 1);
+        ::new (static_cast<void*>(n)) node;
+        try
+        {
+            ::new (static_cast<void*>(n->storage)) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            n->~node();
+            std::allocator_traits<node_allocator>::deallocate(allocator_, n, 1);
+            throw;
+        }
+
+        node* previous = head_.exchange(n, std::memory_order_acq_rel);
+        previous->next.store(n, std::memory_order_release);
+    }
+
+    // Consumer thread only. Hands every item currently visible to f, oldest
+    // first, and returns how many there were.
+    template <typename F>
+    std::size_t consume_all(F&& f)
+    {
+        return consume(std::numeric_limits<std::size_t>::max(), std::forward<F>(f));
+    }
+
+    // Consumer thread only. The same, stopping after max items. An item is
+    // off the queue before f sees it, so an exception from f loses only
+    // that item.
+    template <typename F>
+    std::size_t consume(std::size_t max, F&& f)
+    {
+        std::size_t count = 0;
+        while (count < max)
+        {
+            node* tail = tail_;
+            node* next = tail->next.load(std::memory_order_acquire);
+            if (next == nullptr)
+                break;
+
+            // next becomes the new stub; its value is destroyed once f has
+            // taken it.
+            tail_ = next;
+            release(tail);
+            ++count;
+
+            struct destroy_value
+            {
+                T* value;
+
+                ~destroy_value()
+                {
+                    value->~T();
+                }
+            } taken{ std::launder(reinterpret_cast<T*>(next->storage)) };
+            f(std::move(*taken.value));
+        }
+        return count;
+    }
+
+private:
+    struct node
+    {
+        std::atomic<node*> next{ nullptr };
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<node> node_allocator;
+
+    // Bounded ring of free nodes (after Vyukov's bounded queue), filled by
+    // the consumer alone and emptied by any producer. Each cell carries a
+    // sequence number saying whether it is free to fill or holds a node for
+    // the given position, so a producer claims a node with a single
+    // compare-exchange on a counter that only grows, and a node taken and put
+    // back cannot be mistaken for the one a slower producer saw (no ABA).
+    class node_cache
+    {
+    public:
+        explicit node_cache(std::size_t capacity)
+        {
+            if (capacity == 0)
+                return;
+
+            std::size_t size = 1;
+            while (size < capacity)
+                size <<= 1;
+            cells_ = std::vector<cell>(size);
+            for (std::size_t i = 0; i < size; ++i)
+                cells_[i].sequence.store(i, std::memory_order_relaxed);
+            mask_ = size - 1;
+        }
+
+        // Consumer thread only. Returns false if the ring is full, or there
+        // is none.
+        bool push(node* n)
+        {
+            if (cells_.empty())
+                return false;
+
+            cell& c = cells_[push_position_ & mask_];
+            if (c.sequence.load(std::memory_order_acquire) != push_position_)
+                return false;
+
+            c.free = n;
+            c.sequence.store(++push_position_, std::memory_order_release);
+            return true;
+        }
+
+        // Any thread. Returns nullptr if the ring is empty, or there is none.
+        node* pop()
+        {
+            if (cells_.empty())
+                return nullptr;
+
+            std::size_t position = pop_position_.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                cell& c = cells_[position & mask_];
+                std::size_t sequence = c.sequence.load(std::memory_order_acquire);
+                std::intptr_t difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position + 1);
+                if (difference == 0)
+                {
+                    if (pop_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    {
+                        node* n = c.free;
+                        c.sequence.store(position + mask_ + 1, std::memory_order_release);
+                        return n;
+                    }
+                }
+                else if (difference < 0)
+                {
+                    return nullptr;
+                }
+                else
+                {
+                    position = pop_position_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+    private:
+        struct cell
+        {
+            std::atomic<std::size_t> sequence{ 0 };
+            node* free = nullptr;
+        };
+
+        std::vector<cell> cells_;
+        std::size_t mask_ = 0;
+
+        // The consumer pushes and producers pop; keep the two counters apart.
+        alignas(64) std::size_t push_position_ = 0;
+        alignas(64) std::atomic<std::size_t> pop_position_{ 0 };
+    };
+
+    void release(node* n)
+    {
+        if (n == &stub_)
+            return;
+        n->~node();
+        if (!cache_.push(n))
+            std::allocator_traits<node_allocator>::deallocate(allocator_, n, 1);
+    }
+
+    node_allocator allocator_;
+    node_cache cache_;
+    node stub_;
+
+    // Producers swing head_; the consumer owns tail_. They live on separate
+    // cache lines so producers do not keep stealing the consumer's line.
+    alignas(64) std::atomic<node*> head_;
+    alignas(64) node* tail_;
+};
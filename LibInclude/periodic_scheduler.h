@@ -0,0 +1,191 @@
+#pragma once
+#include <timing_wheel.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <utility>
+
+enum class periodic_mode
+{
+    // Runs are due at fixed points, interval apart from the first, however
+    // long each run takes, so the schedule never drifts. A late run still
+    // happens, once; runs a whole interval or more behind are skipped and
+    // counted as missed.
+    fixed_rate,
+
+    // Each run is due interval after the previous one returned.
+    fixed_delay
+};
+
+// Runs any number of periodic jobs on a timing_wheel.
+//
+// A job is a wheel_timer re-armed from its own handler, so adding, cancelling
+// and each run cost O(1) however many jobs there are. Every job due in the
+// same tick runs from the same wheel handler, one after another. Jitter
+// delays each run by a random amount up to the given bound, so that jobs
+// added together spread over several ticks instead of piling into one; in
+// fixed_rate mode it does not accumulate.
+//
+// Intervals shorter than the wheel's tick are rounded up to it. The scheduler
+// has the threading rules of its wheel: use it, and expect the jobs to run,
+// only on the wheel's executor.
+class periodic_scheduler
+{
+public:
+    typedef std::uint64_t job_id;
+    typedef timing_wheel::clock_type clock_type;
+
+    explicit periodic_scheduler(timing_wheel& wheel)
+        : wheel_(wheel),
+        next_id_(1),
+        running_(nullptr),
+        runs_(0),
+        missed_(0)
+    {
+    }
+
+    periodic_scheduler(const periodic_scheduler&) = delete;
+    periodic_scheduler& operator=(const periodic_scheduler&) = delete;
+
+    // Run f every interval, the first time one interval from now. Returns
+    // the id to cancel it with.
+    template <typename Rep, typename Period>
+    job_id add(std::function<void()> f, std::chrono::duration<Rep, Period> interval,
+        periodic_mode mode = periodic_mode::fixed_rate, clock_type::duration jitter = clock_type::duration::zero())
+    {
+        job_id id = next_id_++;
+        auto j = std::make_unique<job>(*this, id, std::move(f),
+            std::max(std::chrono::duration_cast<clock_type::duration>(interval), wheel_.tick()), mode, jitter);
+        j->due = clock_type::now() + j->interval;
+        j->timer.expires_at(j->due + random_jitter(*j));
+        jobs_.emplace(id, std::move(j));
+        return id;
+    }
+
+    // Stop a job. A job may cancel itself, or any other, while it runs.
+    // Returns false if there is no such job.
+    bool cancel(job_id id)
+    {
+        auto it = jobs_.find(id);
+        if (it == jobs_.end())
+            return false;
+
+        it->second->timer.cancel();
+        if (it->second.get() == running_)
+            retired_ = std::move(it->second);
+        jobs_.erase(it);
+        return true;
+    }
+
+    void cancel_all()
+    {
+        while (!jobs_.empty())
+            cancel(jobs_.begin()->first);
+    }
+
+    std::size_t size() const
+    {
+        return jobs_.size();
+    }
+
+    // Runs made and fixed_rate runs skipped, over all jobs so far.
+    std::uint64_t runs() const
+    {
+        return runs_;
+    }
+
+    std::uint64_t missed() const
+    {
+        return missed_;
+    }
+
+    // Runs of one job skipped so far; 0 for an unknown job.
+    std::uint64_t missed(job_id id) const
+    {
+        auto it = jobs_.find(id);
+        return it == jobs_.end() ? 0 : it->second->missed;
+    }
+
+private:
+    struct job
+    {
+        job(periodic_scheduler& scheduler, job_id id, std::function<void()> f, clock_type::duration interval,
+            periodic_mode mode, clock_type::duration jitter)
+            : timer(scheduler.wheel_, [&scheduler, this]() { scheduler.run(*this); }),
+            id(id),
+            f(std::move(f)),
+            interval(interval),
+            mode(mode),
+            jitter(jitter),
+            missed(0)
+        {
+        }
+
+        wheel_timer timer;
+        job_id id;
+        std::function<void()> f;
+        clock_type::duration interval;
+        periodic_mode mode;
+        clock_type::duration jitter;
+
+        // Next point of a fixed_rate schedule, before jitter.
+        clock_type::time_point due;
+        std::uint64_t missed;
+    };
+
+    void run(job& j)
+    {
+        // A job that cancelled itself last time is freed here, outside its
+        // own timer's handler.
+        retired_.reset();
+
+        ++runs_;
+        running_ = &j;
+        j.f();
+        running_ = nullptr;
+        if (retired_.get() == &j)
+            return;
+
+        if (j.mode == periodic_mode::fixed_delay)
+        {
+            j.timer.expires_after(j.interval + random_jitter(j));
+            return;
+        }
+
+        j.due += j.interval;
+        clock_type::time_point now = clock_type::now();
+        if (now - j.due >= j.interval)
+        {
+            std::uint64_t skipped = static_cast<std::uint64_t>((now - j.due) / j.interval);
+            j.missed += skipped;
+            missed_ += skipped;
+            j.due += j.interval * static_cast<clock_type::rep>(skipped);
+        }
+        j.timer.expires_at(j.due + random_jitter(j));
+    }
+
+    clock_type::duration random_jitter(const job& j)
+    {
+        if (j.jitter <= clock_type::duration::zero())
+            return clock_type::duration::zero();
+        return clock_type::duration(std::uniform_int_distribution<clock_type::rep>(0, j.jitter.count())(random_));
+    }
+
+    timing_wheel& wheel_;
+    std::unordered_map<job_id, std::unique_ptr<job>> jobs_;
+    job_id next_id_;
+
+    // The job whose function is running, and one that cancelled itself.
+    job* running_;
+    std::unique_ptr<job> retired_;
+
+    std::uint64_t runs_;
+    std::uint64_t missed_;
+    std::minstd_rand random_;
+};
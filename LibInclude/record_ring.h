@@ -0,0 +1,178 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Single-producer single-consumer ring of variable-length records, used to
+// hand log records from a logging thread to a background writer.
+//
+// try_push() reserves space, lets the caller fill it in place and publishes it
+// with one release store; front() exposes the oldest record in place and pop()
+// releases it. Records never wrap around the end of the storage, so each one
+// is contiguous, and each starts on its own cache line.
+class record_ring
+{
+public:
+    static constexpr std::size_t alignment = 64;
+
+    // The capacity is rounded up to a power of two of at least 4 KiB.
+    explicit record_ring(std::size_t capacity)
+        : capacity_(round_up(std::max<std::size_t>(capacity, 4096))),
+        storage_(new block[capacity_ / alignment]),
+        closed_(false),
+        head_(0),
+        cached_tail_(0),
+        tail_(0),
+        cached_head_(0)
+    {
+    }
+
+    record_ring(const record_ring&) = delete;
+    record_ring& operator=(const record_ring&) = delete;
+
+    // The largest record try_push() accepts.
+    std::size_t max_record() const
+    {
+        return capacity_ / 4 - sizeof(header);
+    }
+
+    // The same for a ring constructed with the given capacity.
+    static std::size_t max_record(std::size_t capacity)
+    {
+        return round_up(std::max<std::size_t>(capacity, 4096)) / 4 - sizeof(header);
+    }
+
+    // Producer. Reserve bytes (at most max_record()), call fill(void*) to
+    // write them, then publish the record. Returns false, calling nothing, if
+    // the ring is full.
+    template <typename F>
+    bool try_push(std::size_t bytes, F&& fill)
+    {
+        std::size_t total = align(sizeof(header) + bytes);
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        std::size_t offset = head & (capacity_ - 1);
+        std::size_t padding = capacity_ - offset < total ? capacity_ - offset : 0;
+        if (head + padding + total - cached_tail_ > capacity_)
+        {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head + padding + total - cached_tail_ > capacity_)
+                return false;
+        }
+
+        if (padding != 0)
+        {
+            *at(offset) = header{ static_cast<std::uint32_t>(padding), 1 };
+            offset = 0;
+        }
+
+        header* h = at(offset);
+        *h = header{ static_cast<std::uint32_t>(total), 0 };
+        fill(static_cast<void*>(h + 1));
+
+        head_.store(head + padding + total, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer. The oldest record, or nullptr if the ring is empty.
+    const void* front()
+    {
+        for (;;)
+        {
+            std::size_t tail = tail_.load(std::memory_order_relaxed);
+            if (tail == cached_head_)
+            {
+                cached_head_ = head_.load(std::memory_order_acquire);
+                if (tail == cached_head_)
+                    return nullptr;
+            }
+
+            const header* h = at(tail & (capacity_ - 1));
+            if (!h->padding)
+                return h + 1;
+            tail_.store(tail + h->bytes, std::memory_order_release);
+        }
+    }
+
+    // Consumer. Release the record returned by front().
+    void pop()
+    {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        tail_.store(tail + at(tail & (capacity_ - 1))->bytes, std::memory_order_release);
+    }
+
+    // Free-running count of bytes ever pushed. A consumer that has to catch
+    // up with a point in time waits for read() to reach the value it saw.
+    std::size_t written() const
+    {
+        return head_.load(std::memory_order_acquire);
+    }
+
+    std::size_t read() const
+    {
+        return tail_.load(std::memory_order_acquire);
+    }
+
+    bool empty() const
+    {
+        return read() == written();
+    }
+
+    // Set by the producer when it will push nothing more, for example when
+    // its thread exits, so the consumer can retire the ring once it is empty.
+    void close()
+    {
+        closed_.store(true, std::memory_order_release);
+    }
+
+    bool closed() const
+    {
+        return closed_.load(std::memory_order_acquire);
+    }
+
+private:
+    struct header
+    {
+        // The whole record, header included; a multiple of alignment.
+        std::uint32_t bytes;
+
+        // Set on the filler that skips the end of the storage when a record
+        // would not fit before it.
+        std::uint32_t padding;
+    };
+
+    struct alignas(alignment) block
+    {
+        unsigned char bytes[alignment];
+    };
+
+    static std::size_t round_up(std::size_t n)
+    {
+        std::size_t capacity = 1;
+        while (capacity < n)
+            capacity <<= 1;
+        return capacity;
+    }
+
+    static std::size_t align(std::size_t n)
+    {
+        return (n + alignment - 1) & ~(alignment - 1);
+    }
+
+    header* at(std::size_t offset) const
+    {
+        return reinterpret_cast<header*>(reinterpret_cast<unsigned char*>(storage_.get()) + offset);
+    }
+
+    const std::size_t capacity_;
+    const std::unique_ptr<block[]> storage_;
+    std::atomic<bool> closed_;
+
+    // The producer's position and its last look at the consumer's, and the
+    // other way round, each pair on its own cache line.
+    alignas(64) std::atomic<std::size_t> head_;
+    std::size_t cached_tail_;
+    alignas(64) std::atomic<std::size_t> tail_;
+    std::size_t cached_head_;
+};
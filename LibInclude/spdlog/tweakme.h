@@ -111,7 +111,16 @@
 // Uncomment and set to compile time level with zero cost (default is INFO).
 // Macros like SPDLOG_DEBUG(..), SPDLOG_INFO(..)  will expand to empty statements if not enabled
 //
-#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_DEBUG
+// Set per build configuration here: debug builds keep LOG_DEBUG, builds with
+// NDEBUG defined keep LOG_INFO and above. A project can override it with its
+// own SPDLOG_ACTIVE_LEVEL definition.
+#if !defined(SPDLOG_ACTIVE_LEVEL)
+#    if defined(NDEBUG)
+#        define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_INFO
+#    else
+#        define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_DEBUG
+#    endif
+#endif
 ///////////////////////////////////////////////////////////////////////////////
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,81 @@
+#pragma once
+#include <cstdint>
+
+#if defined(__linux__)
+#include <cstring>
+#include <fstream>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Counts system calls, for comparing what the io_context backends cost per
+// message.
+//
+// On Linux this is a perf counter on the raw_syscalls:sys_enter tracepoint,
+// counting the thread that creates it and, with inherit, every thread that
+// thread starts afterwards; threads started before it, such as an async
+// logger's, are not counted. Opening one needs tracefs mounted, to look up
+// the tracepoint, and perf_event_paranoid of -1 or CAP_PERFMON. Where any of
+// that is missing, and on other systems, available() is false and the count
+// stays zero.
+class syscall_counter
+{
+public:
+    explicit syscall_counter(bool inherit = true)
+        : fd_(-1)
+    {
+#if defined(__linux__)
+        std::uint64_t id = 0;
+        for (const char* path : { "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+            "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id" })
+        {
+            std::ifstream file(path);
+            if (file >> id)
+                break;
+        }
+        if (id == 0)
+            return;
+
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = sizeof(attr);
+        attr.config = id;
+        attr.inherit = inherit ? 1 : 0;
+        fd_ = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+        (void)inherit;
+#endif
+    }
+
+    ~syscall_counter()
+    {
+#if defined(__linux__)
+        if (fd_ >= 0)
+            ::close(fd_);
+#endif
+    }
+
+    syscall_counter(const syscall_counter&) = delete;
+    syscall_counter& operator=(const syscall_counter&) = delete;
+
+    bool available() const
+    {
+        return fd_ >= 0;
+    }
+
+    // System calls made since construction. The read itself is one.
+    std::uint64_t count() const
+    {
+        std::uint64_t value = 0;
+#if defined(__linux__)
+        if (fd_ >= 0 && ::read(fd_, &value, sizeof(value)) != sizeof(value))
+            value = 0;
+#endif
+        return value;
+    }
+
+private:
+    int fd_;
+};
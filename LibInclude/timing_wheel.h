@@ -0,0 +1,365 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <system_error>
+#include <utility>
+#include <asio/any_io_executor.hpp>
+#include <asio/io_context.hpp>
+#include <asio/steady_timer.hpp>
+
+class timing_wheel;
+
+// A timer scheduled on a timing_wheel. Embed one in the object it times:
+// arming, re-arming and cancelling only relink it between the wheel's slot
+// lists, so they cost the same however many timers are armed and never
+// allocate.
+//
+// The handler is fixed at construction and runs on the thread running the
+// wheel's io_context; it may re-arm or cancel any timer, but must not destroy
+// its own. Destroying an armed timer cancels it.
+class wheel_timer
+{
+public:
+    wheel_timer(timing_wheel& wheel, std::function<void()> handler)
+        : wheel_(&wheel),
+        handler_(std::move(handler)),
+        next_(nullptr),
+        pprev_(nullptr),
+        expiry_(0)
+    {
+    }
+
+    ~wheel_timer()
+    {
+        cancel();
+    }
+
+    wheel_timer(const wheel_timer&) = delete;
+    wheel_timer& operator=(const wheel_timer&) = delete;
+
+    // Run the handler once delay has passed, rounded up to whole ticks,
+    // replacing any earlier expiry.
+    template <typename Rep, typename Period>
+    void expires_after(std::chrono::duration<Rep, Period> delay);
+
+    // The same with the delay in ticks of the wheel.
+    void expires_after_ticks(std::uint64_t ticks);
+
+    // Run the handler in the first tick at or after time. Unlike a delay
+    // from the current tick, this does not drift when re-armed from the
+    // handler.
+    void expires_at(asio::steady_timer::clock_type::time_point time);
+
+    void cancel();
+
+    bool armed() const
+    {
+        return pprev_ != nullptr;
+    }
+
+private:
+    friend class timing_wheel;
+
+    timing_wheel* wheel_;
+    std::function<void()> handler_;
+
+    // Slot list links; pprev_ points at whichever pointer points at this timer.
+    wheel_timer* next_;
+    wheel_timer** pprev_;
+
+    // Tick at which the handler runs.
+    std::uint64_t expiry_;
+};
+
+// Hierarchical timing wheel (Varghese and Lauck) driven by one steady_timer.
+//
+// Time is counted in ticks of a fixed, coarse length. The first level has a
+// slot per tick for the next 256 ticks; each of the three levels above has 64
+// slots covering 64 times the span of a slot of the level below. A timer is
+// linked into the slot its expiry falls in, and the timers of a higher-level
+// slot are moved down a level when the ticks reach it. Arming and cancelling
+// are O(1), against O(log n) for the heap behind asio's timers.
+//
+// The steady_timer only waits while timers are armed. Delays count from the
+// wheel's current tick rather than the clock, so a timer runs within one tick
+// after its delay as long as the io_context keeps up with the ticks; delays
+// past the 2^26 ticks the wheel spans are cut to that. The wheel, and every
+// timer on it, must only be used from its executor: the thread running its
+// io_context, or a strand.
+class timing_wheel
+{
+public:
+    typedef asio::steady_timer::clock_type clock_type;
+
+    explicit timing_wheel(asio::io_context& io_context, clock_type::duration tick = std::chrono::milliseconds(100))
+        : timing_wheel(io_context.get_executor(), tick)
+    {
+    }
+
+    // Handlers run through executor, which may be a strand.
+    explicit timing_wheel(const asio::any_io_executor& executor, clock_type::duration tick = std::chrono::milliseconds(100))
+        : timer_(executor),
+        tick_(std::max<clock_type::duration>(tick, clock_type::duration(1))),
+        start_(clock_type::now()),
+        now_(1),
+        armed_(0),
+        running_(false),
+        near_{},
+        far_{}
+    {
+    }
+
+    // Armed timers are detached without running.
+    ~timing_wheel()
+    {
+        for (wheel_timer*& slot : near_)
+            detach(slot);
+        for (auto& level : far_)
+        {
+            for (wheel_timer*& slot : level)
+                detach(slot);
+        }
+    }
+
+    timing_wheel(const timing_wheel&) = delete;
+    timing_wheel& operator=(const timing_wheel&) = delete;
+
+    clock_type::duration tick() const
+    {
+        return tick_;
+    }
+
+    // The next tick the wheel will run. Reading it costs nothing, so it is a
+    // cheap coarse clock for timestamping activity against a timer's ticks.
+    std::uint64_t now() const
+    {
+        return now_;
+    }
+
+    // Number of timers armed.
+    std::size_t size() const
+    {
+        return armed_;
+    }
+
+    // Ticks in delay, rounded up, at least one and at most the wheel's span.
+    template <typename Rep, typename Period>
+    std::uint64_t ticks(std::chrono::duration<Rep, Period> delay) const
+    {
+        auto d = std::chrono::duration_cast<clock_type::duration>(delay);
+        if (d <= clock_type::duration::zero())
+            return 1;
+        std::uint64_t n = static_cast<std::uint64_t>((d + tick_ - clock_type::duration(1)) / tick_);
+        return std::clamp<std::uint64_t>(n, 1, max_ticks);
+    }
+
+private:
+    friend class wheel_timer;
+
+    static constexpr int near_bits = 8;
+    static constexpr int far_bits = 6;
+    static constexpr std::size_t near_slots = std::size_t(1) << near_bits;
+    static constexpr std::size_t far_slots = std::size_t(1) << far_bits;
+    static constexpr std::size_t far_levels = 3;
+    static constexpr std::uint64_t max_ticks = (std::uint64_t(1) << (near_bits + far_bits * far_levels)) - 1;
+
+    void arm(wheel_timer& t, std::uint64_t ticks)
+    {
+        cancel(t);
+        catch_up();
+        link(t, now_ + std::clamp<std::uint64_t>(ticks, 1, max_ticks));
+    }
+
+    void arm_at(wheel_timer& t, clock_type::time_point time)
+    {
+        cancel(t);
+        catch_up();
+
+        // The first tick run at or after time.
+        std::uint64_t tick = 0;
+        if (time > start_)
+            tick = static_cast<std::uint64_t>((time - start_ + tick_ - clock_type::duration(1)) / tick_);
+        link(t, std::clamp<std::uint64_t>(tick, now_, now_ + max_ticks));
+    }
+
+    // With nothing armed the wheel is not ticking, so its count is stale; no
+    // timer can be skipped by jumping it to the clock.
+    void catch_up()
+    {
+        if (armed_ == 0 && !running_)
+            now_ = elapsed_ticks() + 1;
+    }
+
+    void link(wheel_timer& t, std::uint64_t expiry)
+    {
+        t.expiry_ = expiry;
+        place(t);
+        ++armed_;
+
+        if (!running_)
+        {
+            running_ = true;
+            schedule();
+        }
+    }
+
+    void cancel(wheel_timer& t)
+    {
+        if (!t.armed())
+            return;
+        unlink(t);
+        --armed_;
+    }
+
+    // Link t into the slot its expiry falls in, relative to now_.
+    void place(wheel_timer& t)
+    {
+        std::uint64_t expiry = std::max(t.expiry_, now_);
+        std::uint64_t delta = expiry - now_;
+        wheel_timer** slot;
+        if (delta < near_slots)
+        {
+            slot = &near_[expiry & (near_slots - 1)];
+        }
+        else
+        {
+            std::size_t level = 0;
+            while (level + 1 < far_levels && delta >= std::uint64_t(1) << (near_bits + far_bits * (level + 1)))
+                ++level;
+            slot = &far_[level][(expiry >> (near_bits + far_bits * level)) & (far_slots - 1)];
+        }
+
+        t.next_ = *slot;
+        if (t.next_ != nullptr)
+            t.next_->pprev_ = &t.next_;
+        t.pprev_ = slot;
+        *slot = &t;
+    }
+
+    static void unlink(wheel_timer& t)
+    {
+        *t.pprev_ = t.next_;
+        if (t.next_ != nullptr)
+            t.next_->pprev_ = t.pprev_;
+        t.next_ = nullptr;
+        t.pprev_ = nullptr;
+    }
+
+    static void detach(wheel_timer*& slot)
+    {
+        while (slot != nullptr)
+            unlink(*slot);
+    }
+
+    // Take the list out of slot, keeping it intact for unlink().
+    static void take(wheel_timer*& slot, wheel_timer*& list)
+    {
+        list = std::exchange(slot, nullptr);
+        if (list != nullptr)
+            list->pprev_ = &list;
+    }
+
+    // Move the timers of the far slot now_ has reached a level down. Returns
+    // the slot's index; at 0 the level above is due as well.
+    std::size_t cascade(std::size_t level)
+    {
+        std::size_t index = (now_ >> (near_bits + far_bits * level)) & (far_slots - 1);
+        wheel_timer* list;
+        take(far_[level][index], list);
+        while (list != nullptr)
+        {
+            wheel_timer& t = *list;
+            unlink(t);
+            place(t);
+        }
+        return index;
+    }
+
+    void run_tick()
+    {
+        std::size_t index = now_ & (near_slots - 1);
+        if (index == 0)
+        {
+            for (std::size_t level = 0; level < far_levels && cascade(level) == 0; ++level)
+            {
+            }
+        }
+
+        wheel_timer* list;
+        take(near_[index], list);
+        ++now_;
+
+        // A handler may cancel timers still in the list, or re-arm its own
+        // into a fresh slot.
+        while (list != nullptr)
+        {
+            wheel_timer& t = *list;
+            unlink(t);
+            --armed_;
+            t.handler_();
+        }
+    }
+
+    std::uint64_t elapsed_ticks() const
+    {
+        return static_cast<std::uint64_t>((clock_type::now() - start_) / tick_);
+    }
+
+    void schedule()
+    {
+        timer_.expires_at(start_ + tick_ * static_cast<clock_type::rep>(now_));
+        timer_.async_wait(
+            [this](std::error_code ec)
+            {
+                if (ec == asio::error::operation_aborted)
+                    return;
+
+                // Catch up on every tick that has passed, one at a time so
+                // that cascades are not skipped.
+                std::uint64_t target = elapsed_ticks();
+                while (now_ <= target && armed_ != 0)
+                    run_tick();
+
+                if (armed_ != 0)
+                    schedule();
+                else
+                    running_ = false;
+            });
+    }
+
+    asio::steady_timer timer_;
+    const clock_type::duration tick_;
+    const clock_type::time_point start_;
+    std::uint64_t now_;
+    std::size_t armed_;
+    bool running_;
+    std::array<wheel_timer*, near_slots> near_;
+    std::array<std::array<wheel_timer*, far_slots>, far_levels> far_;
+};
+
+template <typename Rep, typename Period>
+inline void wheel_timer::expires_after(std::chrono::duration<Rep, Period> delay)
+{
+    wheel_->arm(*this, wheel_->ticks(delay));
+}
+
+inline void wheel_timer::expires_after_ticks(std::uint64_t ticks)
+{
+    wheel_->arm(*this, ticks);
+}
+
+inline void wheel_timer::expires_at(asio::steady_timer::clock_type::time_point time)
+{
+    wheel_->arm_at(*this, time);
+}
+
+inline void wheel_timer::cancel()
+{
+    // A timer left armed when its wheel was destroyed has been detached.
+    if (armed())
+        wheel_->cancel(*this);
+}
@@ -0,0 +1,839 @@
+//
+// benchmark.cpp
+// ~~~~~~~~~~~~~
+//
+// Micro-benchmarks for the hot paths of the samples. Everything runs in
+// process, so the suite needs no network peers and can gate regressions.
+//
+
+#include <LibInclude.h>
+#include <async_log.h>
+#include <bench.h>
+#include <binary_log.h>
+#include <byte_ring.h>
+#include <command_line.h>
+#include <io_locking.h>
+#include <lockfree_strand.h>
+#include <mpsc_queue.h>
+#include <periodic_scheduler.h>
+#include <timing_wheel.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include <asio/asio.hpp>
+#include <spdlog/sinks/ostream_sink.h>
+#include "../Example_Allocation/handler_memory.h"
+#include "../Example_Buffers/shared_const_buffer.h"
+#include "../Example_ChatServer/chat_message.h"
+#include "../Example_ChatServer/chat_room.h"
+
+//----------------------------------------------------------------------
+
+void bench_chat_message(bench::runner& runner)
+{
+    chat_header header;
+    header.body_length = 64;
+    header.room_id = 7;
+    chat_message msg(header);
+    std::memset(msg.body(), 'x', msg.body_length());
+
+    runner.run("chat_message/encode_header",
+        [&msg](std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                msg.encode_header();
+                bench::do_not_optimize(msg);
+            }
+        });
+
+    msg.encode_header();
+    char binary[chat_message::binary_header_length];
+    std::memcpy(binary, msg.data(), sizeof(binary));
+    char legacy[chat_message::legacy_header_length];
+    std::memcpy(legacy, msg.legacy_header(), sizeof(legacy));
+
+    runner.run("chat_message/decode_header/binary",
+        [&binary](std::size_t n)
+        {
+            chat_header decoded;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                bench::do_not_optimize(binary);
+                bench::do_not_optimize(chat_message::decode_header(wire_format::binary, binary, decoded));
+                bench::do_not_optimize(decoded);
+            }
+        });
+
+    runner.run("chat_message/decode_header/legacy",
+        [&legacy](std::size_t n)
+        {
+            chat_header decoded;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                bench::do_not_optimize(legacy);
+                bench::do_not_optimize(chat_message::decode_header(wire_format::legacy, legacy, decoded));
+                bench::do_not_optimize(decoded);
+            }
+        });
+}
+
+//----------------------------------------------------------------------
+
+// Participant that only counts what it is given, so the benchmark measures the
+// room's fan-out rather than a session's write path.
+class counting_participant
+    : public chat_participant
+{
+public:
+    void deliver(const chat_message_ptr& msg)
+    {
+        ++delivered_;
+        bench::do_not_optimize(msg);
+    }
+
+    void deliver_history(const history_ring& history)
+    {
+        delivered_ += history.size();
+    }
+
+private:
+    std::size_t delivered_ = 0;
+};
+
+void bench_chat_room(bench::runner& runner)
+{
+    chat_header header;
+    header.body_length = 64;
+    auto msg = make_chat_message(header);
+    msg->encode_header();
+    chat_message_ptr shared = msg;
+
+    for (std::size_t participants : { 1, 16, 256, 4096 })
+    {
+        std::string name = "chat_room/deliver/participants=" + std::to_string(participants);
+        if (!runner.enabled(name))
+            continue;
+
+        // Joins log at info level; keep thousands of them out of the report.
+        chat_room room(0, chat_room_options());
+        spdlog::set_level(spdlog::level::warn);
+        for (std::size_t i = 0; i < participants; ++i)
+            room.join(std::make_shared<counting_participant>());
+        spdlog::set_level(spdlog::level::info);
+
+        runner.run(name,
+            [&room, &shared](std::size_t n)
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                    room.deliver(shared);
+            });
+    }
+}
+
+//----------------------------------------------------------------------
+
+void bench_allocators(bench::runner& runner)
+{
+    // About the size of an asio socket operation with its handler.
+    constexpr std::size_t size = 256;
+
+    handler_memory memory;
+    runner.run("allocator/handler_allocator",
+        [&memory](std::size_t n)
+        {
+            handler_allocator<char> allocator(memory);
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                char* p = allocator.allocate(size);
+                bench::do_not_optimize(p);
+                allocator.deallocate(p, size);
+            }
+        });
+
+    runner.run("allocator/std_allocator",
+        [](std::size_t n)
+        {
+            std::allocator<char> allocator;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                char* p = allocator.allocate(size);
+                bench::do_not_optimize(p);
+                allocator.deallocate(p, size);
+            }
+        });
+
+    // The same comparison through asio, which allocates the operation that
+    // wraps a posted handler with the handler's associated allocator.
+    asio::io_context io_context(1);
+    auto work = asio::make_work_guard(io_context);
+    std::size_t handled = 0;
+
+    runner.run("post/handler_allocator",
+        [&](std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                asio::post(io_context, asio::bind_allocator(handler_allocator<int>(memory), [&handled]() { ++handled; }));
+                io_context.poll();
+            }
+        });
+
+    runner.run("post/default_allocator",
+        [&](std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                asio::post(io_context, [&handled]() { ++handled; });
+                io_context.poll();
+            }
+        });
+
+    if (memory.fallbacks() != 0)
+        LOG_WARN("bench: handler_memory fell back to the heap {} times", memory.fallbacks());
+}
+
+//----------------------------------------------------------------------
+
+// chat_client's submit path: a writer thread builds messages with a pooled
+// 64 byte body and pushes them, the consumer takes and destroys them, so
+// queue nodes and bodies are all allocated on one thread and freed on the
+// other. Also logs how often message_pool took its shared mutex per message.
+template <typename Queue>
+void run_submit_bench(bench::runner& runner, const std::string& name, Queue& queue)
+{
+    if (!runner.enabled(name))
+        return;
+
+    chat_header header;
+    header.body_length = 64;
+
+    // One long-lived writer, so that its thread cache stays warm; each batch
+    // hands it a count to push. Both sides yield while waiting, for machines
+    // with fewer cores than threads.
+    std::atomic<std::size_t> batch{ 0 };
+    std::atomic<bool> done{ false };
+    std::thread writer(
+        [&]()
+        {
+            while (!done.load(std::memory_order_acquire))
+            {
+                std::size_t n = batch.exchange(0, std::memory_order_acq_rel);
+                if (n == 0)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                for (std::size_t i = 0; i < n; ++i)
+                    queue.emplace(header);
+            }
+        });
+
+    std::uint64_t messages = 0;
+    std::uint64_t locks = message_pool::shared_locks();
+    runner.run(name,
+        [&](std::size_t n)
+        {
+            batch.store(n, std::memory_order_release);
+            for (std::size_t taken = 0; taken < n; )
+            {
+                std::size_t count = queue.consume_all([](chat_message&& msg) { bench::do_not_optimize(msg); });
+                if (count == 0)
+                    std::this_thread::yield();
+                taken += count;
+            }
+            messages += n;
+        });
+
+    done.store(true, std::memory_order_release);
+    writer.join();
+
+    if (messages != 0)
+    {
+        LOG_INFO("bench: {} pool_locks/message={:.5f}", name,
+            static_cast<double>(message_pool::shared_locks() - locks) / messages);
+    }
+}
+
+void bench_submit_queue(bench::runner& runner)
+{
+    // Nodes from message_pool, crossing threads through its shared list.
+    mpsc_queue<chat_message, message_pool_allocator<chat_message>> pooled;
+    run_submit_bench(runner, "mpsc/submit/pool_nodes", pooled);
+
+    // Nodes recycled through the queue's own node cache, as chat_client does.
+    mpsc_queue<chat_message> cached(4096);
+    run_submit_bench(runner, "mpsc/submit/node_cache", cached);
+}
+
+//----------------------------------------------------------------------
+
+void bench_shared_const_buffer(bench::runner& runner)
+{
+    std::string data(64, 'x');
+    runner.run("shared_const_buffer/construct",
+        [&data](std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                shared_const_buffer buffer(data);
+                bench::do_not_optimize(buffer);
+            }
+        });
+}
+
+//----------------------------------------------------------------------
+
+// Post n handlers to the executors and wait for all of them to run.
+//
+// With one thread the caller posts everything and then runs the io_context
+// itself. With more, that many workers run the io_context for the whole
+// benchmark and the caller only posts and waits, so thread start-up stays out
+// of the measurement.
+class post_bench
+{
+public:
+    explicit post_bench(std::size_t threads)
+        : io_context_(static_cast<int>(threads)),
+        threads_(threads)
+    {
+        if (threads_ == 1)
+            return;
+
+        work_.emplace(asio::make_work_guard(io_context_));
+        for (std::size_t i = 0; i < threads_; ++i)
+            workers_.emplace_back([this]() { io_context_.run(); });
+    }
+
+    ~post_bench()
+    {
+        work_.reset();
+        for (auto& t : workers_)
+            t.join();
+    }
+
+    asio::io_context& io_context()
+    {
+        return io_context_;
+    }
+
+    // Spreads the handlers round-robin over executors.
+    template <typename Executor>
+    void run(const std::vector<Executor>& executors, std::size_t n)
+    {
+        done_.store(0, std::memory_order_relaxed);
+        std::size_t next = 0;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            asio::post(executors[next],
+                [this, n]()
+                {
+                    if (done_.fetch_add(1, std::memory_order_acq_rel) + 1 == n)
+                        done_.notify_one();
+                });
+            next = next + 1 == executors.size() ? 0 : next + 1;
+        }
+
+        if (threads_ == 1)
+        {
+            io_context_.run();
+            io_context_.restart();
+            return;
+        }
+
+        for (std::size_t done = done_.load(std::memory_order_acquire); done != n; done = done_.load(std::memory_order_acquire))
+            done_.wait(done, std::memory_order_acquire);
+    }
+
+private:
+    asio::io_context io_context_;
+    std::size_t threads_;
+    std::optional<asio::executor_work_guard<asio::io_context::executor_type>> work_;
+    std::vector<std::thread> workers_;
+    std::atomic<std::size_t> done_{ 0 };
+};
+
+template <typename MakeStrand>
+auto make_strands(std::size_t count, MakeStrand make)
+{
+    std::vector<decltype(make())> strands;
+    strands.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+        strands.push_back(make());
+    return strands;
+}
+
+// Posting throughput against the number of strands and of threads running
+// them. asio's strands map onto a fixed pool of mutexes, so many strands on
+// many threads collide on them; lockfree_strand has no shared state.
+void bench_strand(bench::runner& runner)
+{
+    for (std::size_t threads : { 1, 4 })
+    {
+        std::string suffix = "/threads=" + std::to_string(threads);
+        bool enabled = runner.enabled("io_context/post" + suffix);
+        for (std::size_t strands : { 1, 16, 1024 })
+        {
+            std::string strands_suffix = suffix + "/strands=" + std::to_string(strands);
+            enabled = enabled || runner.enabled("strand/post" + strands_suffix)
+                || runner.enabled("lockfree_strand/post" + strands_suffix);
+        }
+        if (!enabled)
+            continue;
+
+        post_bench posts(threads);
+        std::vector<asio::io_context::executor_type> plain{ posts.io_context().get_executor() };
+        runner.run("io_context/post" + suffix,
+            [&](std::size_t n) { posts.run(plain, n); });
+
+        for (std::size_t strands : { 1, 16, 1024 })
+        {
+            std::string strands_suffix = suffix + "/strands=" + std::to_string(strands);
+            if (runner.enabled("strand/post" + strands_suffix))
+            {
+                auto executors = make_strands(strands, [&]() { return asio::make_strand(posts.io_context()); });
+                runner.run("strand/post" + strands_suffix,
+                    [&](std::size_t n) { posts.run(executors, n); });
+            }
+
+            if (runner.enabled("lockfree_strand/post" + strands_suffix))
+            {
+                auto executors = make_strands(strands, [&]() { return make_lockfree_strand(posts.io_context()); });
+                runner.run("lockfree_strand/post" + strands_suffix,
+                    [&](std::size_t n) { posts.run(executors, n); });
+            }
+        }
+    }
+}
+
+//----------------------------------------------------------------------
+
+// Handler throughput of an io_context run by one thread in each io_locking
+// mode: a chain of handlers each posting the next, which pays the scheduler's
+// lock, and a byte bounced between the two ends of a socket pair, which also
+// pays the reactor's.
+class ping_pong
+{
+public:
+    explicit ping_pong(asio::io_context& io_context)
+        : a_(io_context),
+        b_(io_context)
+    {
+        asio::local::connect_pair(a_, b_);
+    }
+
+    void run(asio::io_context& io_context, std::size_t n)
+    {
+        remaining_ = n;
+        serve(a_, b_);
+        io_context.run();
+        io_context.restart();
+    }
+
+private:
+    // Write a byte from one end and, once the other has read it, send it
+    // back the other way.
+    void serve(asio::local::stream_protocol::socket& from, asio::local::stream_protocol::socket& to)
+    {
+        if (remaining_-- == 0)
+            return;
+
+        asio::async_write(from, asio::buffer(&byte_, 1), [](std::error_code, std::size_t) {});
+        asio::async_read(to, asio::buffer(&received_, 1),
+            [this, &from, &to](std::error_code ec, std::size_t)
+            {
+                if (!ec)
+                    serve(to, from);
+            });
+    }
+
+    asio::local::stream_protocol::socket a_;
+    asio::local::stream_protocol::socket b_;
+    std::size_t remaining_ = 0;
+    char byte_ = 'x';
+    char received_ = 0;
+};
+
+void bench_io_locking(bench::runner& runner)
+{
+    for (io_locking locking : { io_locking::safe, io_locking::unsafe_io, io_locking::unsafe })
+    {
+        std::string suffix = std::string("/") + io_locking_name(locking);
+        asio::io_context io_context(concurrency_hint(locking));
+
+        runner.run("io_locking/post_chain" + suffix,
+            [&io_context](std::size_t n)
+            {
+                std::function<void()> next;
+                next = [&io_context, &next, n]() mutable
+                {
+                    if (--n != 0)
+                        asio::post(io_context, [&next]() { next(); });
+                };
+                asio::post(io_context, [&next]() { next(); });
+                io_context.run();
+                io_context.restart();
+            });
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+        if (runner.enabled("io_locking/ping_pong" + suffix))
+        {
+            ping_pong sockets(io_context);
+            runner.run("io_locking/ping_pong" + suffix,
+                [&](std::size_t n) { sockets.run(io_context, n); });
+        }
+#endif
+    }
+}
+
+//----------------------------------------------------------------------
+
+// Re-arming one of many armed timers, as a session does on every write. The
+// steady_timer case also pays for completing the wait it cancels.
+void bench_timers(bench::runner& runner)
+{
+    for (std::size_t count : { 1000, 100000 })
+    {
+        std::string suffix = "/timers=" + std::to_string(count);
+        asio::io_context io_context(1);
+
+        if (runner.enabled("timer/wheel/rearm" + suffix))
+        {
+            timing_wheel wheel(io_context);
+            std::vector<std::unique_ptr<wheel_timer>> timers;
+            timers.reserve(count);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                timers.push_back(std::make_unique<wheel_timer>(wheel, []() {}));
+                timers.back()->expires_after(std::chrono::seconds(1 + i % 60));
+            }
+
+            std::size_t next = 0;
+            runner.run("timer/wheel/rearm" + suffix,
+                [&](std::size_t n)
+                {
+                    for (std::size_t i = 0; i < n; ++i)
+                    {
+                        timers[next]->expires_after(std::chrono::seconds(30));
+                        next = next + 1 == count ? 0 : next + 1;
+                    }
+                });
+        }
+
+        if (runner.enabled("timer/steady_timer/rearm" + suffix))
+        {
+            std::vector<std::unique_ptr<asio::steady_timer>> timers;
+            timers.reserve(count);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                timers.push_back(std::make_unique<asio::steady_timer>(io_context, std::chrono::seconds(1 + i % 60)));
+                timers.back()->async_wait([](std::error_code) {});
+            }
+
+            std::size_t next = 0;
+            runner.run("timer/steady_timer/rearm" + suffix,
+                [&](std::size_t n)
+                {
+                    for (std::size_t i = 0; i < n; ++i)
+                    {
+                        timers[next]->expires_after(std::chrono::seconds(30));
+                        timers[next]->async_wait([](std::error_code) {});
+                        next = next + 1 == count ? 0 : next + 1;
+                    }
+                    io_context.poll();
+                });
+
+            timers.clear();
+            io_context.poll();
+        }
+    }
+
+    // Adding and cancelling a job among many, as a housekeeping task that
+    // comes and goes would.
+    if (runner.enabled("periodic/add_cancel/jobs=10000"))
+    {
+        asio::io_context io_context(1);
+        timing_wheel wheel(io_context);
+        periodic_scheduler scheduler(wheel);
+        for (std::size_t i = 0; i < 10000; ++i)
+            scheduler.add([]() {}, std::chrono::seconds(10), periodic_mode::fixed_rate, std::chrono::seconds(1));
+
+        runner.run("periodic/add_cancel/jobs=10000",
+            [&scheduler](std::size_t n)
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                    scheduler.cancel(scheduler.add([]() {}, std::chrono::seconds(10)));
+            });
+    }
+}
+
+//----------------------------------------------------------------------
+
+// Stream buffer that discards everything, so the logging benchmarks measure
+// formatting and hand-off rather than the console.
+class null_streambuf
+    : public std::streambuf
+{
+protected:
+    int overflow(int c)
+    {
+        return c;
+    }
+
+    std::streamsize xsputn(const char*, std::streamsize n)
+    {
+        return n;
+    }
+};
+
+void bench_logging(bench::runner& runner)
+{
+    // The shape of the chat server's per-message debug line.
+    std::string body(64, 'x');
+    auto log_line = [&body](spdlog::logger& logger, std::size_t n)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+            logger.debug("message read. id={}, room={}, body={}", static_cast<const void*>(&body), i, std::string_view(body));
+    };
+
+    null_streambuf discard;
+    std::ostream out(&discard);
+
+    {
+        spdlog::logger sync("bench", std::make_shared<spdlog::sinks::ostream_sink_mt>(out));
+        sync.set_pattern("%Y-%m-%d %H:%M:%S.%e | %L | %t | %v | %s:%#");
+        sync.set_level(spdlog::level::debug);
+        runner.run("log/sync", [&](std::size_t n) { log_line(sync, n); });
+    }
+
+    // The calling thread's cost: the ring holds every message of a run, so
+    // the caller never waits for the background thread.
+    for (auto overflow : { async_overflow_policy::block, async_overflow_policy::drop })
+    {
+        std::string name = overflow == async_overflow_policy::block ? "log/async/block" : "log/async/drop";
+        if (!runner.enabled(name))
+            continue;
+
+        async_log_options options;
+        options.ring_bytes = std::size_t(1) << 26;
+        options.overflow = overflow;
+        std::vector<spdlog::sink_ptr> sinks{ std::make_shared<spdlog::sinks::ostream_sink_mt>(out) };
+        spdlog::logger async("bench", std::make_shared<async_log_sink>(std::move(sinks), options));
+        async.set_pattern("%Y-%m-%d %H:%M:%S.%e | %L | %t | %v | %s:%#");
+        async.set_level(spdlog::level::debug);
+        runner.run(name, [&](std::size_t n) { log_line(async, n); });
+        async.flush();
+    }
+
+    // The same statement recorded by binary_log, which formats nothing on the
+    // calling thread.
+    if (runner.enabled("log/binary"))
+    {
+        std::string path = (std::filesystem::temp_directory_path() / "benchmark.blog").string();
+        async_log_options options;
+        options.ring_bytes = std::size_t(1) << 26;
+        if (!binary_log::open(path, options))
+        {
+            LOG_WARN("bench: cannot create {}", path);
+            return;
+        }
+
+        static constexpr binary_log_site site{ __FILE__, __LINE__, SPDLOG_FUNCTION, spdlog::level::debug };
+        runner.run("log/binary",
+            [&body](std::size_t n)
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                    binary_log::write(site, "message read. id={}, room={}, body={}", static_cast<const void*>(&body), i, std::string_view(body));
+            });
+
+        binary_log::close();
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+    }
+}
+
+//----------------------------------------------------------------------
+
+// The chat server's read path, so the cost of a disabled statement shows
+// against what a session does for each message. chat_session lives in the
+// server's main.cpp, so this repeats the frame loop of its deliver_frames()
+// over the same parts: a byte_ring refilled with pipelined binary frames, a
+// pooled message per frame and delivery to a room of one participant.
+class frame_reader
+{
+public:
+    explicit frame_reader(std::size_t ring_bytes)
+        : ring_(ring_bytes),
+        room_(7, chat_room_options())
+    {
+        chat_header header;
+        header.body_length = 64;
+        header.room_id = 7;
+        chat_message msg(header);
+        std::memset(msg.body(), 'x', msg.body_length());
+        msg.encode_header();
+
+        // As many whole frames as one read can fill the ring with.
+        while (wire_.size() + msg.length() <= ring_.capacity())
+            wire_.insert(wire_.end(), msg.data(), msg.data() + msg.length());
+
+        spdlog::set_level(spdlog::level::warn);
+        room_.join(std::make_shared<counting_participant>());
+        spdlog::set_level(spdlog::level::info);
+    }
+
+    // Read n messages, calling log(session, msg) where the session logs each.
+    template <typename Log>
+    void run(std::size_t n, Log&& log)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            // What async_read_some does once the ring is drained.
+            if (ring_.empty())
+                ring_.commit(asio::buffer_copy(ring_.prepare(), asio::buffer(wire_)));
+
+            char header_data[chat_message::binary_header_length];
+            ring_.peek(header_data, sizeof(header_data));
+            chat_header header;
+            chat_message::decode_header(wire_format::binary, header_data, header);
+            ring_.consume(sizeof(header_data));
+
+            auto msg = make_chat_message(header);
+            ring_.peek(msg->body(), msg->body_length());
+            ring_.consume(msg->body_length());
+
+            log(static_cast<const void*>(this), *msg);
+            room_.deliver(std::move(msg));
+        }
+    }
+
+private:
+    byte_ring ring_;
+    chat_room room_;
+    std::vector<char> wire_;
+};
+
+// Without the session's per-message statement, and with it compiled in but
+// below the runtime level, where the logger checks its level and nothing
+// else runs. Defined here, before this file raises its module level.
+void bench_read_path_logging(bench::runner& runner, frame_reader& reader)
+{
+    runner.run("log/disabled/none",
+        [&reader](std::size_t n) { reader.run(n, [](const void*, const chat_message&) {}); });
+
+    runner.run("log/disabled/runtime",
+        [&reader](std::size_t n)
+        {
+            reader.run(n,
+                [](const void* session, const chat_message& m)
+                {
+                    LOG_DEBUG_RATE(100, "message read. id={}, room={}, type={}, msg={}", session, m.room_id(),
+                        static_cast<int>(m.type()), std::string_view(m.body(), m.body_length()));
+                });
+        });
+}
+
+// Compiled out in every configuration: this module's level is above debug.
+#undef LOG_MODULE_LEVEL
+#define LOG_MODULE_LEVEL    SPDLOG_LEVEL_INFO
+
+void bench_disabled_logging(bench::runner& runner)
+{
+    // The server's default read buffer.
+    frame_reader reader(16 * 1024);
+    bench_read_path_logging(runner, reader);
+
+    runner.run("log/disabled/compiled_out",
+        [&reader](std::size_t n)
+        {
+            reader.run(n,
+                [](const void* session, const chat_message& m)
+                {
+                    LOG_DEBUG_RATE(100, "message read. id={}, room={}, type={}, msg={}", session, m.room_id(),
+                        static_cast<int>(m.type()), std::string_view(m.body(), m.body_length()));
+                });
+        });
+}
+
+#undef LOG_MODULE_LEVEL
+#define LOG_MODULE_LEVEL    SPDLOG_LEVEL_TRACE
+
+// Sampled and rate-limited statements, nearly all of them suppressed by their
+// call site. While a batch runs, the default logger is one that discards the
+// few lines that get through; the report still goes to the console.
+void bench_limited_logging(bench::runner& runner)
+{
+    null_streambuf discard;
+    std::ostream out(&discard);
+    auto quiet = std::make_shared<spdlog::logger>("bench", std::make_shared<spdlog::sinks::ostream_sink_mt>(out));
+    auto console = spdlog::default_logger();
+
+    std::string body(64, 'x');
+    runner.run("log/limited/every_n=1000",
+        [&](std::size_t n)
+        {
+            spdlog::set_default_logger(quiet);
+            for (std::size_t i = 0; i < n; ++i)
+                LOG_INFO_EVERY_N(1000, "message read. id={}, room={}, body={}", static_cast<const void*>(&body), i, std::string_view(body));
+            spdlog::set_default_logger(console);
+        });
+
+    runner.run("log/limited/rate=100",
+        [&](std::size_t n)
+        {
+            spdlog::set_default_logger(quiet);
+            for (std::size_t i = 0; i < n; ++i)
+                LOG_INFO_RATE(100, "message read. id={}, room={}, body={}", static_cast<const void*>(&body), i, std::string_view(body));
+            spdlog::set_default_logger(console);
+        });
+}
+
+//----------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    spdlog_default_initialize();
+
+    // Debug logging inside the measured code would dominate it.
+    spdlog::set_level(spdlog::level::info);
+
+    try
+    {
+        // Usage: Benchmark [--filter=substring] [--samples=N] [--warmup=N]
+        //                  [--min-sample-us=N] [--json=path]
+        // Each benchmark reports nanoseconds per operation; --json also writes
+        // the results to a file for comparison between runs.
+        command_line args(argc, argv);
+        bench::runner runner(bench::parse_options(args));
+
+        bench_chat_message(runner);
+        bench_chat_room(runner);
+        bench_allocators(runner);
+        bench_submit_queue(runner);
+        bench_shared_const_buffer(runner);
+        bench_strand(runner);
+        bench_io_locking(runner);
+        bench_timers(runner);
+        bench_logging(runner);
+        bench_disabled_logging(runner);
+        bench_limited_logging(runner);
+
+        return runner.finish() ? 0 : 1;
+    }
+    catch (std::exception& e)
+    {
+        LOG_ERROR("Exception: {}", e.what());
+    }
+
+    return 1;
+}
@@ -0,0 +1,142 @@
+//
+// handler_memory.h
+// ~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2003-2021 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#pragma once
+#include <allocation_tracker.h>
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+// Class to manage the memory to be used for handler-based custom allocation.
+// It holds as many slots as a session has operations in flight: a duplex
+// session keeps a read and a write outstanding at once, and the lockstep and
+// splice sessions one operation at a time. Each slot is sized for the largest
+// operation the sessions allocate, 208 to 288 bytes with the epoll backend,
+// with room for backends whose operations are bigger. A request that is too
+// large, or made while every slot is taken, goes to the global heap; such
+// fallbacks are counted so that a steady state can be checked for them.
+class handler_memory
+{
+public:
+    static constexpr std::size_t slot_size = 512;
+    static constexpr std::size_t slot_count = 2;
+
+    handler_memory()
+        : in_use_(0),
+        allocations_(0),
+        fallbacks_(0)
+    {
+    }
+
+    handler_memory(const handler_memory&) = delete;
+    handler_memory& operator=(const handler_memory&) = delete;
+
+    void* allocate(std::size_t size)
+    {
+        ++allocations_;
+        if (size <= slot_size && in_use_ != full_mask)
+        {
+            std::size_t slot = std::countr_one(in_use_);
+            in_use_ |= static_cast<std::uint8_t>(1u << slot);
+            return storage_ + slot * slot_size;
+        }
+
+        ++fallbacks_;
+        allocation_tracker::count_fallback();
+        return ::operator new(size);
+    }
+
+    void deallocate(void* pointer)
+    {
+        unsigned char* p = static_cast<unsigned char*>(pointer);
+        if (p >= storage_ && p < storage_ + sizeof(storage_))
+        {
+            std::size_t slot = (p - storage_) / slot_size;
+            in_use_ &= static_cast<std::uint8_t>(~(1u << slot));
+        }
+        else
+        {
+            ::operator delete(pointer);
+        }
+    }
+
+    // Number of allocation requests, and how many of them went to the heap.
+    std::size_t allocations() const
+    {
+        return allocations_;
+    }
+
+    std::size_t fallbacks() const
+    {
+        return fallbacks_;
+    }
+
+private:
+    static_assert(slot_count <= 8, "slot occupancy is tracked in one byte");
+    static constexpr std::uint8_t full_mask = static_cast<std::uint8_t>((1u << slot_count) - 1);
+
+    // Storage space used for handler-based custom memory allocation. The slot
+    // size is a multiple of the maximum alignment.
+    alignas(std::max_align_t) unsigned char storage_[slot_size * slot_count];
+
+    // One bit per slot, set while the slot is allocated.
+    std::uint8_t in_use_;
+
+    std::size_t allocations_;
+    std::size_t fallbacks_;
+};
+
+// The allocator to be associated with the handler objects. This allocator only
+// needs to satisfy the C++11 minimal allocator requirements.
+template <typename T>
+class handler_allocator
+{
+public:
+    using value_type = T;
+
+    explicit handler_allocator(handler_memory& mem)
+        : memory_(mem)
+    {
+    }
+
+    template <typename U>
+    handler_allocator(const handler_allocator<U>& other) noexcept
+        : memory_(other.memory_)
+    {
+    }
+
+    bool operator==(const handler_allocator& other) const noexcept
+    {
+        return &memory_ == &other.memory_;
+    }
+
+    bool operator!=(const handler_allocator& other) const noexcept
+    {
+        return &memory_ != &other.memory_;
+    }
+
+    T* allocate(std::size_t n) const
+    {
+        return static_cast<T*>(memory_.allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* p, std::size_t /*n*/) const
+    {
+        return memory_.deallocate(p);
+    }
+
+private:
+    template <typename> friend class handler_allocator;
+
+    // The underlying memory.
+    handler_memory& memory_;
+};
@@ -9,182 +9,431 @@
 //
 
 #include <LibInclude.h>
+#include <allocation_tracker.h>
+#include <byte_ring.h>
+#include <command_line.h>
+#include <io_backend.h>
+#include <io_locking.h>
+#include <syscall_counter.h>
+
+#include <algorithm>
 #include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <memory>
-#include <type_traits>
+#include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 #include <asio/asio.hpp>
+#include "handler_memory.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using asio::ip::tcp;
 
-// Class to manage the memory to be used for handler-based custom allocation.
-// It contains a single block of memory which may be returned for allocation
-// requests. If the memory is in use when an allocation request is made, the
-// allocator delegates allocation to the global heap.
-class handler_memory
+class session
+    : public std::enable_shared_from_this<session>
 {
 public:
-    handler_memory()
-        : in_use_(false)
+    session(tcp::socket socket)
+        : socket_(std::move(socket))
     {
     }
 
-    handler_memory(const handler_memory&) = delete;
-    handler_memory& operator=(const handler_memory&) = delete;
-
-    void* allocate(std::size_t size)
+    ~session()
     {
-        if (!in_use_ && size < sizeof(storage_))
-        {
-            LOG_DEBUG("handler_memory use allocate. size={}", size);
-            in_use_ = true;
-            return &storage_;
-        }
-        else
-        {
-            LOG_DEBUG("handler_memory new allocate. size={}", size);
-            return ::operator new(size);
-        }
+        LOG_INFO("session closed. handler_allocations={}, heap_fallbacks={}",
+            handler_memory_.allocations(), handler_memory_.fallbacks());
     }
 
-    void deallocate(void* pointer)
+    void start()
     {
-        if (pointer == &storage_)
-        {
-            LOG_DEBUG("handler_memory use deallocate");
-            in_use_ = false;
-        }
-        else
-        {
-            LOG_DEBUG("handler_memory new deallocate");
-            ::operator delete(pointer);
-        }
+        auto end_point = socket_.local_endpoint();
+        auto adress = end_point.address();
+        auto port = end_point.port();
+        LOG_INFO("session start : {}:{}", adress.to_string(), port);
+        do_read();
     }
 
 private:
-    // Storage space used for handler-based custom memory allocation.
-    typename std::aligned_storage<1024>::type storage_;
+    // Handlers draw on the session's memory, and every allocation they make is
+    // reported to allocation_tracker.
+    typedef counting_allocator<int, handler_allocator<int>> allocator_type;
+
+    allocator_type allocator()
+    {
+        return allocator_type(handler_allocator<int>(handler_memory_));
+    }
 
-    // Whether the handler-based custom allocation storage has been used.
-    bool in_use_;
+    void do_read()
+    {
+        auto self(shared_from_this());
+        socket_.async_read_some(asio::buffer(data_), 
+            asio::bind_allocator(allocator(),
+                [this, self](std::error_code ec, std::size_t length)
+                {
+                    if (!ec)
+                    {
+                        LOG_DEBUG("sessio do_read. data={}", std::string_view(data_.begin(), data_.begin() + length));
+                        do_write(length);
+                    }
+                }));
+    }
+
+    void do_write(std::size_t length)
+    {
+        auto self(shared_from_this());
+        asio::async_write(socket_, asio::buffer(data_, length),
+            asio::bind_allocator(allocator(),
+                [this, self](std::error_code ec, std::size_t length)
+                {
+                    if (!ec)
+                    {
+                        allocation_tracker::count_operation();
+                        LOG_DEBUG("sessio do_write. data={}", std::string_view(data_.begin(), data_.begin() + length));
+                        do_read();
+                    }
+                }));
+    }
+
+    // The socket used to communicate with the client.
+    tcp::socket socket_;
+
+    // Buffer used to store data received from the client.
+    std::array<char, 1024> data_;
+
+    // The memory to use for handler-based custom memory allocation.
+    handler_memory handler_memory_;
 };
 
-// The allocator to be associated with the handler objects. This allocator only
-// needs to satisfy the C++11 minimal allocator requirements.
-template <typename T>
-class handler_allocator
+// Echo session that reads and writes at the same time. Received bytes go into
+// a ring; a read is kept outstanding for as long as the ring has free space,
+// and a write of everything buffered so far is kept outstanding for as long as
+// the ring has data. The session only stops reading when the ring is full,
+// which is also how backpressure from a slow reader reaches the peer.
+class duplex_session
+    : public std::enable_shared_from_this<duplex_session>
 {
 public:
-    using value_type = T;
+    duplex_session(tcp::socket socket, std::size_t buffer_bytes)
+        : socket_(std::move(socket)),
+        buffer_(buffer_bytes),
+        reading_(false),
+        writing_(false),
+        stopped_(false)
+    {
+    }
 
-    explicit handler_allocator(handler_memory& mem)
-        : memory_(mem)
+    ~duplex_session()
     {
+        LOG_INFO("duplex session closed. handler_allocations={}, heap_fallbacks={}",
+            handler_memory_.allocations(), handler_memory_.fallbacks());
     }
 
-    template <typename U>
-    handler_allocator(const handler_allocator<U>& other) noexcept
-        : memory_(other.memory_)
+    void start()
     {
+        auto end_point = socket_.local_endpoint();
+        LOG_INFO("duplex session start : {}:{}, buffer={}", end_point.address().to_string(), end_point.port(), buffer_.capacity());
+        do_read();
     }
 
-    bool operator==(const handler_allocator& other) const noexcept
+private:
+    typedef counting_allocator<int, handler_allocator<int>> allocator_type;
+
+    allocator_type allocator()
     {
-        return &memory_ == &other.memory_;
+        return allocator_type(handler_allocator<int>(handler_memory_));
     }
 
-    bool operator!=(const handler_allocator& other) const noexcept
+    void stop()
     {
-        return &memory_ != &other.memory_;
+        if (stopped_)
+            return;
+        stopped_ = true;
+
+        std::error_code ignored;
+        socket_.close(ignored);
     }
 
-    T* allocate(std::size_t n) const
+    void do_read()
     {
-        return static_cast<T*>(memory_.allocate(sizeof(T) * n));
+        if (reading_ || stopped_ || buffer_.full())
+            return;
+
+        reading_ = true;
+        auto self(shared_from_this());
+        socket_.async_read_some(buffer_.prepare(),
+            asio::bind_allocator(allocator(),
+                [this, self](std::error_code ec, std::size_t length)
+                {
+                    reading_ = false;
+                    if (ec)
+                    {
+                        // Echo what is still buffered before closing on EOF.
+                        if (ec == asio::error::eof && writing_)
+                            return;
+                        stop();
+                        return;
+                    }
+
+                    buffer_.commit(length);
+                    do_write();
+                    do_read();
+                }));
     }
 
-    void deallocate(T* p, std::size_t /*n*/) const
+    void do_write()
     {
-        return memory_.deallocate(p);
+        if (writing_ || stopped_ || buffer_.empty())
+            return;
+
+        writing_ = true;
+        auto self(shared_from_this());
+        socket_.async_write_some(buffer_.data(),
+            asio::bind_allocator(allocator(),
+                [this, self](std::error_code ec, std::size_t length)
+                {
+                    writing_ = false;
+                    if (ec)
+                    {
+                        stop();
+                        return;
+                    }
+
+                    allocation_tracker::count_operation();
+
+                    // A read may be filling the ring right now, so the
+                    // positions must not be rewound under it.
+                    buffer_.consume_no_rewind(length);
+                    do_write();
+                    do_read();
+                }));
     }
 
-private:
-    template <typename> friend class handler_allocator;
+    tcp::socket socket_;
+
+    // Bytes received and not yet echoed back.
+    byte_ring buffer_;
+    bool reading_;
+    bool writing_;
+    bool stopped_;
 
-    // The underlying memory.
-    handler_memory& memory_;
+    // The memory to use for handler-based custom memory allocation. It has a
+    // slot for the read and the write that are in flight together.
+    handler_memory handler_memory_;
 };
 
-class session
-    : public std::enable_shared_from_this<session>
+#if defined(__linux__)
+// Echo session that never copies the payload into user space: bytes are moved
+// socket -> pipe -> socket with splice(2). The socket is non-blocking and the
+// session waits for readiness through the reactor with async_wait, draining
+// as much as it can on each wakeup. It waits for the socket to be readable
+// only while the pipe is empty and for it to be writable only while the pipe
+// holds data, so at most one wait is ever outstanding.
+//
+// If splice turns out not to work on the socket, the connection is handed to
+// duplex_session before any byte has been moved.
+class splice_session
+    : public std::enable_shared_from_this<splice_session>
 {
 public:
-    session(tcp::socket socket)
-        : socket_(std::move(socket))
+    splice_session(tcp::socket socket, std::size_t pipe_bytes)
+        : socket_(std::move(socket)),
+        pipe_{ -1, -1 },
+        pipe_capacity_(pipe_bytes),
+        buffered_(0),
+        spliced_(0),
+        eof_(false),
+        stopped_(false)
+    {
+    }
+
+    ~splice_session()
     {
+        if (pipe_[0] != -1)
+        {
+            ::close(pipe_[0]);
+            ::close(pipe_[1]);
+            LOG_INFO("splice session closed. bytes={}, handler_allocations={}, heap_fallbacks={}",
+                spliced_, handler_memory_.allocations(), handler_memory_.fallbacks());
+        }
     }
 
     void start()
     {
+        if (::pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) != 0)
+        {
+            LOG_WARN("splice unavailable, pipe2 failed. errno={}", errno);
+            fall_back();
+            return;
+        }
+
+        // Ask for a pipe as large as the copy path's buffer; the kernel may
+        // round it or refuse, so use whatever it reports.
+        ::fcntl(pipe_[1], F_SETPIPE_SZ, static_cast<int>(pipe_capacity_));
+        int size = ::fcntl(pipe_[1], F_GETPIPE_SZ);
+        if (size > 0)
+            pipe_capacity_ = static_cast<std::size_t>(size);
+
+        socket_.non_blocking(true);
+
         auto end_point = socket_.local_endpoint();
-        auto adress = end_point.address();
-        auto port = end_point.port();
-        LOG_INFO("session start : {}:{}", adress.to_string(), port);
-        do_read();
+        LOG_INFO("splice session start : {}:{}, pipe={}", end_point.address().to_string(), end_point.port(), pipe_capacity_);
+        pump();
     }
 
 private:
-    void do_read()
+    typedef counting_allocator<int, handler_allocator<int>> allocator_type;
+
+    allocator_type allocator()
     {
-        auto self(shared_from_this());
-        socket_.async_read_some(asio::buffer(data_), 
-            asio::bind_allocator(handler_allocator<int>(handler_memory_),
-                [this, self](std::error_code ec, std::size_t length)
+        return allocator_type(handler_allocator<int>(handler_memory_));
+    }
+
+    // Hand the connection to the copying path.
+    void fall_back()
+    {
+        std::error_code ignored;
+        socket_.non_blocking(false, ignored);
+        std::make_shared<duplex_session>(std::move(socket_), pipe_capacity_)->start();
+    }
+
+    void stop()
+    {
+        if (stopped_)
+            return;
+        stopped_ = true;
+
+        std::error_code ignored;
+        socket_.close(ignored);
+    }
+
+    // Move data until both directions would block, then wait for the one
+    // that lets us make progress.
+    void pump()
+    {
+        int fd = socket_.native_handle();
+        for (;;)
+        {
+            bool progress = false;
+
+            if (!eof_ && buffered_ < pipe_capacity_)
+            {
+                ssize_t n = ::splice(fd, nullptr, pipe_[1], nullptr, pipe_capacity_ - buffered_,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0)
                 {
-                    if (!ec)
+                    buffered_ += n;
+                    progress = true;
+                }
+                else if (n == 0)
+                {
+                    eof_ = true;
+                }
+                else if (errno != EAGAIN)
+                {
+                    if ((errno == EINVAL || errno == ENOSYS) && spliced_ == 0 && buffered_ == 0)
                     {
-                        LOG_DEBUG("sessio do_read. data={}", std::string_view(data_.begin(), data_.begin() + length));
-                        do_write(length);
+                        LOG_WARN("splice unavailable on socket, using copy path. errno={}", errno);
+                        fall_back();
+                        return;
                     }
-                }));
-    }
+                    stop();
+                    return;
+                }
+            }
+
+            if (buffered_ > 0)
+            {
+                ssize_t n = ::splice(pipe_[0], nullptr, fd, nullptr, buffered_,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0)
+                {
+                    buffered_ -= n;
+                    spliced_ += n;
+                    allocation_tracker::count_operation();
+                    progress = true;
+                }
+                else if (n < 0 && errno != EAGAIN)
+                {
+                    stop();
+                    return;
+                }
+            }
+
+            if (!progress)
+                break;
+        }
+
+        if (buffered_ == 0 && eof_)
+        {
+            stop();
+            return;
+        }
 
-    void do_write(std::size_t length)
-    {
         auto self(shared_from_this());
-        asio::async_write(socket_, asio::buffer(data_, length),
-            asio::bind_allocator(handler_allocator<int>(handler_memory_),
-                [this, self](std::error_code ec, std::size_t length)
+        socket_.async_wait(buffered_ == 0 ? tcp::socket::wait_read : tcp::socket::wait_write,
+            asio::bind_allocator(allocator(),
+                [this, self](std::error_code ec)
                 {
-                    if (!ec)
+                    if (ec)
                     {
-                        LOG_DEBUG("sessio do_write. data={}", std::string_view(data_.begin(), data_.begin() + length));
-                        do_read();
+                        stop();
+                        return;
                     }
+
+                    pump();
                 }));
     }
 
-    // The socket used to communicate with the client.
     tcp::socket socket_;
 
-    // Buffer used to store data received from the client.
-    std::array<char, 1024> data_;
+    // Read and write ends of the pipe the payload passes through, and how
+    // many bytes it holds.
+    int pipe_[2];
+    std::size_t pipe_capacity_;
+    std::size_t buffered_;
+
+    std::size_t spliced_;
+    bool eof_;
+    bool stopped_;
 
-    // The memory to use for handler-based custom memory allocation.
     handler_memory handler_memory_;
 };
+#endif
+
+// How the server echoes.
+enum class echo_mode
+{
+    lockstep,   // session: read, then write, then read again
+    duplex,     // duplex_session: overlapping reads and writes through a ring
+    splice      // splice_session on Linux, duplex_session elsewhere
+};
 
 class server
 {
 public:
-    server(asio::io_context& io_context, short port)
-        : acceptor_(io_context, tcp::endpoint(tcp::v4(), port))
+    server(asio::io_context& io_context, unsigned short port, echo_mode mode, std::size_t buffer_bytes)
+        : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)),
+        mode_(mode),
+        buffer_bytes_(buffer_bytes)
     {
         do_accept();
     }
 
+    unsigned short port() const
+    {
+        return acceptor_.local_endpoint().port();
+    }
+
 private:
     void do_accept()
     {
@@ -193,7 +442,22 @@ private:
             {
                 if (!ec)
                 {
-                    std::make_shared<session>(std::move(socket))->start();
+                    switch (mode_)
+                    {
+                    case echo_mode::lockstep:
+                        std::make_shared<session>(std::move(socket))->start();
+                        break;
+                    case echo_mode::splice:
+#if defined(__linux__)
+                        std::make_shared<splice_session>(std::move(socket), buffer_bytes_)->start();
+                        break;
+#else
+                        [[fallthrough]];
+#endif
+                    case echo_mode::duplex:
+                        std::make_shared<duplex_session>(std::move(socket), buffer_bytes_)->start();
+                        break;
+                    }
                 }
 
                 do_accept();
@@ -201,23 +465,138 @@ private:
     }
 
     tcp::acceptor acceptor_;
+    echo_mode mode_;
+    std::size_t buffer_bytes_;
 };
 
+// CPU time consumed by the calling thread.
+double thread_cpu_seconds()
+{
+#if defined(_WIN32)
+    FILETIME creation, exit, kernel, user;
+    ::GetThreadTimes(::GetCurrentThread(), &creation, &exit, &kernel, &user);
+    auto ticks = [](const FILETIME& t) { return (static_cast<std::uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+    return (ticks(kernel) + ticks(user)) * 1e-7;
+#else
+    timespec ts;
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// Stream bytes through an in-process echo server over loopback and report the
+// throughput, and the CPU time and system calls the server thread spent per
+// byte echoed, the latter where syscall_counter is available. The
+// server's io_context locks as locking says; it is stopped through a mailbox,
+// the only way in from another thread that is safe in every mode.
+void run_echo_bench(const char* name, echo_mode mode, io_locking locking, std::size_t bytes, std::size_t buffer_bytes)
+{
+    asio::io_context io_context(concurrency_hint(locking));
+    io_mailbox mailbox(io_context, locking);
+    server s(io_context, 0, mode, buffer_bytes);
+
+    double server_cpu = 0;
+    std::string server_syscalls = "n/a";
+    std::thread server_thread(
+        [&io_context, &server_cpu, &server_syscalls, bytes]()
+        {
+            syscall_counter syscalls(false);
+            double start = thread_cpu_seconds();
+            io_context.run();
+            server_cpu = thread_cpu_seconds() - start;
+            if (syscalls.available())
+                server_syscalls = fmt::format("{:.1f}", syscalls.count() * 1e6 / bytes);
+        });
+
+    asio::io_context client_context;
+    tcp::socket client(client_context);
+    client.connect(tcp::endpoint(asio::ip::address_v4::loopback(), s.port()));
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread writer(
+        [&client, bytes]()
+        {
+            std::vector<char> chunk(64 * 1024, 'x');
+            for (std::size_t sent = 0; sent < bytes; )
+                sent += asio::write(client, asio::buffer(chunk.data(), std::min(chunk.size(), bytes - sent)));
+        });
+
+    std::vector<char> sink(64 * 1024);
+    std::size_t received = 0;
+    while (received < bytes)
+        received += client.read_some(asio::buffer(sink));
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    writer.join();
+    client.close();
+    mailbox.post([&io_context]() { io_context.stop(); });
+    server_thread.join();
+
+    LOG_INFO("bench: path={}, io_backend={}, io_locking={}, bytes={}, seconds={:.3f}, MB/s={:.1f}, server_cpu_ns/byte={:.3f}, server_syscalls/MB={}",
+        name, io_backend_name(), io_locking_name(effective_io_locking(locking)), bytes, seconds, bytes / seconds / 1e6,
+        server_cpu * 1e9 / bytes, server_syscalls);
+}
+
 int main(int argc, char* argv[])
 {
     spdlog_default_initialize();
 
     try
     {
-        if (argc != 2)
+        // Usage: server <port> [--duplex | --splice] [--buffer-bytes=N] [--io-locking=safe|unsafe_io|unsafe]
+        //        server --bench [--bench-bytes=N] [--buffer-bytes=N]
+        // --duplex echoes with overlapping reads and writes through a ring of
+        // --buffer-bytes (default 64 KiB) instead of in lockstep. --splice
+        // moves the bytes with splice(2) through a pipe of that size on Linux
+        // and falls back to --duplex elsewhere. --io-locking drops the locks
+        // of the server's io_context, which only the main thread runs; see
+        // io_locking.h. --bench streams --bench-bytes (default 1 GiB) through
+        // each path with each locking mode over loopback and reports them.
+        command_line args(argc, argv);
+        std::size_t buffer_bytes = std::max<std::size_t>(1, args.get<std::size_t>("buffer-bytes", 64 * 1024));
+
+        if (args.get("bench", false))
+        {
+            std::size_t bytes = args.get<std::size_t>("bench-bytes", std::size_t(1) << 30);
+            for (io_locking locking : { io_locking::safe, io_locking::unsafe_io, io_locking::unsafe })
+            {
+                run_echo_bench("copy", echo_mode::duplex, locking, bytes, buffer_bytes);
+#if defined(__linux__)
+                run_echo_bench("splice", echo_mode::splice, locking, bytes, buffer_bytes);
+#endif
+            }
+            return 0;
+        }
+
+        if (args.positional_count() != 1)
         {
-            LOG_ERROR("Usage: server <port>");
+            LOG_ERROR("Usage: server <port> [--duplex | --splice] [--buffer-bytes=N] | server --bench [--bench-bytes=N]");
             return 1;
         }
 
-        asio::io_context io_context;
-        server s(io_context, std::atoi(argv[1]));
+        echo_mode mode = echo_mode::lockstep;
+        if (args.get("splice", false))
+            mode = echo_mode::splice;
+        else if (args.get("duplex", false))
+            mode = echo_mode::duplex;
+
+        io_locking locking = io_locking::safe;
+        std::string locking_name = args.get<std::string>("io-locking", "safe");
+        if (!parse_io_locking(locking_name, locking))
+            LOG_WARN("unknown --io-locking={}, using safe", locking_name);
+
+        asio::io_context io_context(concurrency_hint(locking));
+        server s(io_context, static_cast<unsigned short>(std::atoi(args.positional(0).c_str())), mode, buffer_bytes);
+
+        asio::signal_set signals(io_context, SIGINT, SIGTERM);
+        signals.async_wait([&io_context](std::error_code, int) { io_context.stop(); });
+
         io_context.run();
+
+        // An operation is one message echoed back to its client.
+        allocation_counters totals = allocation_tracker::snapshot();
+        LOG_INFO("allocations: ops={}, allocations/op={:.3f}, bytes/op={:.1f}, fallbacks={}, fallback_rate={:.4f}",
+            totals.operations, totals.allocations_per_op(), totals.bytes_per_op(), totals.fallbacks, totals.fallback_rate());
     }
     catch (std::exception& e)
     {
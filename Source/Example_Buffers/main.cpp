@@ -16,41 +16,11 @@
 #include <type_traits>
 #include <utility>
 #include <asio/asio.hpp>
+#include "shared_const_buffer.h"
 
 using asio::ip::tcp;
 
 
-// A reference-counted non-modifiable buffer class.
-class shared_const_buffer
-{
-public:
-    // Construct from a std::string.
-    explicit shared_const_buffer(const std::string& data)
-        : data_(new std::vector<char>(data.begin(), data.end())),
-        buffer_(asio::buffer(*data_))
-    {
-        LOG_DEBUG("shared_const_buffer constructor. ref_count={}", data_.use_count());
-    }
-
-    // Implement the ConstBufferSequence requirements.
-    typedef asio::const_buffer value_type;
-    typedef const asio::const_buffer* const_iterator;
-    const asio::const_buffer* begin() const 
-    {
-        LOG_DEBUG("shared_const_buffer begin call");
-        return &buffer_; 
-    }
-    const asio::const_buffer* end() const 
-    { 
-        LOG_DEBUG("shared_const_buffer end call");
-        return &buffer_ + 1; 
-    }
-
-private:
-    std::shared_ptr<std::vector<char> > data_;
-    asio::const_buffer buffer_;
-};
-
 class session
     : public std::enable_shared_from_this<session>
 {
@@ -0,0 +1,47 @@
+//
+// shared_const_buffer.h
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2003-2021 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#pragma once
+#include <LibInclude.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <asio/buffer.hpp>
+
+// A reference-counted non-modifiable buffer class.
+class shared_const_buffer
+{
+public:
+    // Construct from a std::string.
+    explicit shared_const_buffer(const std::string& data)
+        : data_(new std::vector<char>(data.begin(), data.end())),
+        buffer_(asio::buffer(*data_))
+    {
+        LOG_DEBUG("shared_const_buffer constructor. ref_count={}", data_.use_count());
+    }
+
+    // Implement the ConstBufferSequence requirements.
+    typedef asio::const_buffer value_type;
+    typedef const asio::const_buffer* const_iterator;
+    const asio::const_buffer* begin() const 
+    {
+        LOG_DEBUG("shared_const_buffer begin call");
+        return &buffer_; 
+    }
+    const asio::const_buffer* end() const 
+    { 
+        LOG_DEBUG("shared_const_buffer end call");
+        return &buffer_ + 1; 
+    }
+
+private:
+    std::shared_ptr<std::vector<char> > data_;
+    asio::const_buffer buffer_;
+};
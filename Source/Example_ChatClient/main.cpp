@@ -9,146 +9,223 @@
 //
 
 #include <LibInclude.h>
-
+#include <command_line.h>
+#include <latency_histogram.h>
+#include <mpsc_queue.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <deque>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <utility>
+#include <vector>
 #include <asio/asio.hpp>
+#include "../Example_ChatServer/chat_message.h"
 
 using asio::ip::tcp;
 
-#include <cstdio>
-#include <cstdlib>
-#include <cstring>
+typedef std::deque<chat_message> chat_message_queue;
 
-class chat_message
+// Hooks for code that drives a chat_client itself, such as the load generator.
+// They run on the client's io_context thread.
+struct chat_client_handlers
 {
-public:
-    enum { header_length = 4 };
-    enum { max_body_length = 512 };
-
-    chat_message()
-        : body_length_(0)
-    {
-    }
+    // The framing has been settled and writes are being sent.
+    std::function<void()> on_ready;
 
-    const char* data() const
-    {
-        return data_;
-    }
-
-    char* data()
-    {
-        return data_;
-    }
+    // A complete message has been read.
+    std::function<void(const chat_message&)> on_message;
+};
 
-    std::size_t length() const
-    {
-        return header_length + body_length_;
-    }
+class chat_client
+{
+public:
+    // How long to wait for the server to answer the binary framing preamble
+    // before assuming it only speaks the legacy framing.
+    static constexpr asio::chrono::seconds negotiate_timeout{ 2 };
 
-    const char* body() const
+    chat_client(asio::io_context& io_context,
+        const tcp::resolver::results_type& endpoints,
+        bool legacy,
+        chat_client_handlers handlers = chat_client_handlers())
+        : io_context_(io_context),
+        handlers_(std::move(handlers)),
+        socket_(io_context),
+        negotiate_timer_(io_context),
+        read_format_(wire_format::legacy),
+        write_format_(wire_format::legacy),
+        negotiating_(!legacy),
+        writing_(false),
+        submit_queue_(submit_node_cache),
+        drain_scheduled_(false)
     {
-        return data_ + header_length;
+        do_connect(endpoints);
     }
 
-    char* body()
+    // Safe to call from any number of threads. The message is moved into an
+    // mpsc_queue, and only the call that finds no drain pending posts one to
+    // the io_context, so a burst of writes costs a single handler. Queue nodes
+    // come back to the writers through the queue's node cache without a lock.
+    // The message body's pooled block is freed on the io_context thread and
+    // reaches the writers through message_pool's shared list, whose mutex is
+    // taken once to spill and once to refill each half cache of blocks: for
+    // bodies up to 244 bytes, twice per 512 messages (see the mpsc/submit
+    // benchmark).
+    void write(chat_message msg)
     {
-        return data_ + header_length;
+        submit_queue_.push(std::move(msg));
+        if (!drain_scheduled_.exchange(true, std::memory_order_acq_rel))
+        {
+            asio::post(io_context_, [this]() { drain_submissions(); });
+        }
     }
 
-    std::size_t body_length() const
+    void close()
     {
-        return body_length_;
+        asio::post(io_context_, [this]() { socket_.close(); negotiate_timer_.cancel(); });
     }
 
-    void body_length(std::size_t new_length)
+private:
+    void drain_submissions()
     {
-        body_length_ = new_length;
-        if (body_length_ > max_body_length)
-            body_length_ = max_body_length;
-    }
+        // Clear the flag before draining: a producer that pushes after this
+        // point either has its message taken below or sees the flag clear and
+        // posts another drain. The exchange synchronises with the producers'
+        // exchanges, so every push made before them is visible here.
+        drain_scheduled_.exchange(false, std::memory_order_acq_rel);
+
+        std::size_t count = submit_queue_.consume_all(
+            [this](chat_message&& msg)
+            {
+                write_msgs_.push_back(std::move(msg));
+            });
+        LOG_TRACE("submissions drained. count={}", count);
 
-    bool decode_header()
-    {
-        char header[header_length + 1] = "";
-        std::strncat(header, data_, header_length);
-        body_length_ = std::atoi(header);
-        if (body_length_ > max_body_length)
+        if (count != 0 && !writing_ && !negotiating_)
         {
-            body_length_ = 0;
-            return false;
+            do_write();
         }
-        return true;
     }
 
-    void encode_header()
+    void do_connect(const tcp::resolver::results_type& endpoints)
     {
-        char header[header_length + 1] = "";
-        std::sprintf(header, "%4d", static_cast<int>(body_length_));
-        std::memcpy(data_, header, header_length);
-    }
-
-private:
-    char data_[header_length + max_body_length];
-    std::size_t body_length_;
-};
-
-
-typedef std::deque<chat_message> chat_message_queue;
+        asio::async_connect(socket_, endpoints,
+            [this](std::error_code ec, tcp::endpoint)
+            {
+                if (!ec)
+                {
+                    // Each write is a whole message or a batch of them.
+                    std::error_code option_ec;
+                    socket_.set_option(tcp::no_delay(true), option_ec);
 
-class chat_client
-{
-public:
-    chat_client(asio::io_context& io_context,
-        const tcp::resolver::results_type& endpoints)
-        : io_context_(io_context),
-        socket_(io_context)
-    {
-        do_connect(endpoints);
+                    if (negotiating_)
+                    {
+                        do_negotiate();
+                    }
+                    else if (handlers_.on_ready)
+                    {
+                        handlers_.on_ready();
+                    }
+                    do_read_header();
+                }
+            });
     }
 
-    void write(const chat_message& msg)
+    // Ask for the binary framing. Writes are held back until the server
+    // answers, or until the timeout says it is a legacy server.
+    void do_negotiate()
     {
-        asio::post(io_context_,
-            [this, msg]()
+        chat_preamble::encode(preamble_, chat_preamble::version);
+
+        writing_ = true;
+        asio::async_write(socket_, asio::buffer(preamble_),
+            [this](std::error_code ec, std::size_t /*length*/)
             {
-                bool write_in_progress = !write_msgs_.empty();
-                write_msgs_.push_back(msg);
-                if (!write_in_progress)
+                writing_ = false;
+                if (ec)
+                {
+                    socket_.close();
+                }
+                else if (!negotiating_ && !write_msgs_.empty())
                 {
                     do_write();
                 }
             });
-    }
-
-    void close()
-    {
-        asio::post(io_context_, [this]() { socket_.close(); });
-    }
 
-private:
-    void do_connect(const tcp::resolver::results_type& endpoints)
-    {
-        asio::async_connect(socket_, endpoints,
-            [this](std::error_code ec, tcp::endpoint)
+        negotiate_timer_.expires_after(negotiate_timeout);
+        negotiate_timer_.async_wait(
+            [this](std::error_code ec)
             {
-                if (!ec)
+                if (!ec && negotiating_)
                 {
-                    do_read_header();
+                    LOG_WARN("server did not answer the binary preamble, using legacy framing");
+                    finish_negotiation(wire_format::legacy);
                 }
             });
     }
 
+    void finish_negotiation(wire_format format)
+    {
+        negotiating_ = false;
+        read_format_ = format;
+        write_format_ = format;
+        negotiate_timer_.cancel();
+
+        if (!writing_ && !write_msgs_.empty())
+        {
+            do_write();
+        }
+
+        if (handlers_.on_ready)
+        {
+            handlers_.on_ready();
+        }
+    }
+
     void do_read_header()
     {
         asio::async_read(socket_,
-            asio::buffer(read_msg_.data(), chat_message::header_length),
+            asio::buffer(read_header_, chat_message::header_length(read_format_)),
             [this](std::error_code ec, std::size_t /*length*/)
             {
-                if (!ec && read_msg_.decode_header())
+                if (ec)
+                {
+                    socket_.close();
+                    return;
+                }
+
+                // The server's preamble marks where its output turns binary.
+                if (read_format_ == wire_format::legacy && chat_preamble::decode(read_header_) != 0)
+                {
+                    if (!negotiating_)
+                    {
+                        LOG_ERROR("server answered the binary preamble after the legacy fallback");
+                        socket_.close();
+                        return;
+                    }
+
+                    LOG_DEBUG("binary framing negotiated. version={}", static_cast<int>(chat_preamble::decode(read_header_)));
+                    finish_negotiation(wire_format::binary);
+                    do_read_header();
+                    return;
+                }
+
+                chat_header header;
+                if (chat_message::decode_header(read_format_, read_header_, header))
                 {
+                    read_msg_ = chat_message(header);
                     do_read_body();
                 }
                 else
@@ -166,7 +243,11 @@ private:
             {
                 if (!ec)
                 {
-                    LOG_DEBUG("read body. msg={}", std::string_view(read_msg_.body(), read_msg_.body_length()));
+                    LOG_DEBUG("read body. room={}, msg={}", read_msg_.room_id(), std::string_view(read_msg_.body(), read_msg_.body_length()));
+                    if (handlers_.on_message)
+                    {
+                        handlers_.on_message(read_msg_);
+                    }
                     do_read_header();
                 }
                 else
@@ -178,11 +259,47 @@ private:
 
     void do_write()
     {
-        asio::async_write(socket_,
-            asio::buffer(write_msgs_.front().data(),
-                write_msgs_.front().length()),
+        const chat_message& msg = write_msgs_.front();
+        if (write_format_ == wire_format::legacy && !msg.fits_legacy())
+        {
+            LOG_WARN("message dropped, too long for legacy framing. length={}", msg.body_length());
+            write_msgs_.pop_front();
+            if (!write_msgs_.empty())
+            {
+                do_write();
+            }
+            return;
+        }
+
+        // The legacy header has no room or type; those servers only have room 0.
+        if (write_format_ == wire_format::legacy
+            && (msg.type() != chat_message_type::chat || msg.room_id() != 0))
+        {
+            LOG_WARN("message dropped, rooms need binary framing. room={}", msg.room_id());
+            write_msgs_.pop_front();
+            if (!write_msgs_.empty())
+            {
+                do_write();
+            }
+            return;
+        }
+
+        std::array<asio::const_buffer, 2> buffers;
+        if (write_format_ == wire_format::binary)
+        {
+            buffers = { { asio::buffer(msg.data(), msg.length()), asio::const_buffer() } };
+        }
+        else
+        {
+            buffers = { { asio::buffer(msg.legacy_header(), chat_message::legacy_header_length),
+                asio::buffer(msg.body(), msg.body_length()) } };
+        }
+
+        writing_ = true;
+        asio::async_write(socket_, buffers,
             [this](std::error_code ec, std::size_t /*length*/)
             {
+                writing_ = false;
                 if (!ec)
                 {
                     auto& msg = write_msgs_.front();
@@ -203,37 +320,442 @@ private:
 
 private:
     asio::io_context& io_context_;
+    chat_client_handlers handlers_;
     tcp::socket socket_;
+    asio::steady_timer negotiate_timer_;
+    wire_format read_format_;
+    wire_format write_format_;
+    bool negotiating_;
+    bool writing_;
+    char preamble_[chat_preamble::length];
+    char read_header_[chat_message::binary_header_length];
     chat_message read_msg_;
     chat_message_queue write_msgs_;
+
+    // Messages submitted by write() and not yet taken by the io_context
+    // thread, with enough recycled nodes for a burst of that many.
+    static constexpr std::size_t submit_node_cache = 4096;
+    mpsc_queue<chat_message> submit_queue_;
+    std::atomic<bool> drain_scheduled_;
+};
+
+//----------------------------------------------------------------------
+
+struct load_options
+{
+    std::size_t connections = 100;
+    std::size_t threads = 1;
+
+    // Messages per second each connection sends. Zero runs closed-loop: a
+    // connection sends its next message as soon as its previous one comes
+    // back from the server, or once echo_timeout has passed without it, which
+    // counts the message as timed out.
+    double rate = 0;
+    std::chrono::milliseconds echo_timeout{ 1000 };
+
+    std::chrono::seconds duration{ 10 };
+    std::chrono::seconds connect_timeout{ 10 };
+    std::size_t body_bytes = 64;
+
+    // With rooms > 0, connection i moves from room 0 to room 1 + i % rooms;
+    // otherwise every connection talks in room 0 and sees every message.
+    std::uint32_t rooms = 0;
+    bool legacy = false;
+};
+
+// Written at the front of every load message body. The run token tells this
+// run's messages from history left in the server by earlier runs.
+struct load_stamp
+{
+    std::uint64_t run;
+    std::int64_t sent_ns;
+    std::uint32_t connection;
+    std::uint32_t sequence;
+};
+
+// State shared by every connection of a run.
+struct load_run
+{
+    std::uint64_t token = 0;
+    std::atomic<std::size_t> ready{ 0 };
+    std::atomic<bool> sending{ false };
+};
+
+// Counters for the connections of one io_context. Only its thread writes them.
+// Each connection is in the room it sends to, so every message it sends should
+// come back to it: echoed counts those that did, and the rest were lost, most
+// likely dropped by the server's overflow policy.
+struct load_stats
+{
+    latency_histogram latency;
+    std::uint64_t sent = 0;
+    std::uint64_t delivered = 0;
+    std::uint64_t echoed = 0;
+    std::uint64_t timeouts = 0;
+};
+
+inline std::int64_t load_clock_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// One load generator connection. Everything after construction runs on its
+// io_context's thread.
+class load_connection
+{
+public:
+    load_connection(asio::io_context& io_context, const load_options& options,
+        load_run& run, load_stats& stats, std::uint32_t id)
+        : io_context_(io_context),
+        options_(options),
+        run_(run),
+        stats_(stats),
+        id_(id),
+        room_(options.rooms != 0 ? 1 + id % options.rooms : 0),
+        sequence_(0),
+        timer_(io_context)
+    {
+    }
+
+    void open(const tcp::resolver::results_type& endpoints)
+    {
+        chat_client_handlers handlers;
+        handlers.on_ready = [this]() { on_ready(); };
+        handlers.on_message = [this](const chat_message& msg) { on_message(msg); };
+        client_ = std::make_unique<chat_client>(io_context_, endpoints, options_.legacy, std::move(handlers));
+    }
+
+    void start()
+    {
+        if (options_.rate <= 0)
+        {
+            send_next();
+            return;
+        }
+
+        interval_ = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(1.0 / options_.rate));
+        next_send_ = std::chrono::steady_clock::now();
+        schedule_next();
+    }
+
+    void close()
+    {
+        timer_.cancel();
+        if (client_)
+            client_->close();
+    }
+
+private:
+    void on_ready()
+    {
+        if (room_ != 0)
+        {
+            chat_message join;
+            join.type(chat_message_type::join);
+            join.room_id(room_);
+            join.encode_header();
+            client_->write(std::move(join));
+
+            chat_message leave;
+            leave.type(chat_message_type::leave);
+            leave.room_id(0);
+            leave.encode_header();
+            client_->write(std::move(leave));
+        }
+
+        run_.ready.fetch_add(1, std::memory_order_release);
+    }
+
+    void on_message(const chat_message& msg)
+    {
+        if (msg.type() != chat_message_type::chat || msg.body_length() < sizeof(load_stamp))
+            return;
+
+        load_stamp stamp;
+        std::memcpy(&stamp, msg.body(), sizeof(stamp));
+        if (stamp.run != run_.token)
+            return;
+
+        stats_.latency.record(static_cast<std::uint64_t>(std::max<std::int64_t>(0, load_clock_ns() - stamp.sent_ns)));
+        ++stats_.delivered;
+        if (stamp.connection != id_)
+            return;
+        ++stats_.echoed;
+
+        // Closed loop: our own message is back, send the next one.
+        if (options_.rate <= 0 && stamp.sequence + 1 == sequence_)
+            send_next();
+    }
+
+    // Closed loop: move on if the message just sent does not come back in
+    // time, so that a message the server dropped does not stall the
+    // connection for the rest of the run.
+    void wait_for_echo()
+    {
+        timer_.expires_after(options_.echo_timeout);
+        timer_.async_wait(
+            [this, sequence = sequence_](std::error_code ec)
+            {
+                if (ec || sequence != sequence_ || !run_.sending.load(std::memory_order_relaxed))
+                    return;
+                ++stats_.timeouts;
+                send_next();
+            });
+    }
+
+    void schedule_next()
+    {
+        // Fixed rate: sends are due at regular times. A connection that falls
+        // behind catches up with back-to-back sends, but never by more than
+        // one second's worth.
+        next_send_ += interval_;
+        auto now = std::chrono::steady_clock::now();
+        if (next_send_ < now - std::chrono::seconds(1))
+            next_send_ = now;
+
+        timer_.expires_at(next_send_);
+        timer_.async_wait(
+            [this](std::error_code ec)
+            {
+                if (ec || !run_.sending.load(std::memory_order_relaxed))
+                    return;
+                send_next();
+                schedule_next();
+            });
+    }
+
+    void send_next()
+    {
+        if (!run_.sending.load(std::memory_order_relaxed))
+            return;
+
+        chat_message msg;
+        msg.room_id(room_);
+        msg.body_length(std::max(options_.body_bytes, sizeof(load_stamp)));
+        std::memset(msg.body(), 'x', msg.body_length());
+
+        load_stamp stamp{ run_.token, load_clock_ns(), id_, sequence_++ };
+        std::memcpy(msg.body(), &stamp, sizeof(stamp));
+        msg.encode_header();
+
+        client_->write(std::move(msg));
+        ++stats_.sent;
+
+        if (options_.rate <= 0)
+            wait_for_echo();
+    }
+
+    asio::io_context& io_context_;
+    const load_options& options_;
+    load_run& run_;
+    load_stats& stats_;
+    std::uint32_t id_;
+    std::uint32_t room_;
+    std::uint32_t sequence_;
+    std::unique_ptr<chat_client> client_;
+
+    // Fixed-rate sending, or the closed loop's echo timeout.
+    asio::steady_timer timer_;
+    std::chrono::steady_clock::duration interval_{};
+    std::chrono::steady_clock::time_point next_send_;
 };
 
+// Open the connections across the io_context threads, wait for them to be
+// ready, drive traffic for the configured duration and report throughput,
+// connect rate and fan-out latency: the time from a message being sent to
+// each copy of it being read back, over every connection in its room.
+void run_load(const tcp::resolver::results_type& endpoints, const load_options& options)
+{
+    load_run run;
+    run.token = static_cast<std::uint64_t>(load_clock_ns()) ^ (static_cast<std::uint64_t>(std::random_device()()) << 32);
+
+    std::vector<std::unique_ptr<asio::io_context>> contexts;
+    std::vector<asio::executor_work_guard<asio::io_context::executor_type>> work;
+    std::vector<load_stats> stats(options.threads);
+    for (std::size_t i = 0; i < options.threads; ++i)
+    {
+        contexts.push_back(std::make_unique<asio::io_context>(1));
+        work.push_back(asio::make_work_guard(*contexts.back()));
+    }
+
+    std::vector<std::thread> threads;
+    for (auto& context : contexts)
+        threads.emplace_back([&context]() { context->run(); });
+
+    // Each connection is created on its own thread, so its handlers can never
+    // run before it is fully set up.
+    auto connect_start = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<load_connection>> connections;
+    for (std::size_t i = 0; i < options.connections; ++i)
+    {
+        std::size_t t = i % options.threads;
+        connections.push_back(std::make_unique<load_connection>(*contexts[t], options, run, stats[t], static_cast<std::uint32_t>(i)));
+        load_connection* connection = connections.back().get();
+        asio::post(*contexts[t], [connection, &endpoints]() { connection->open(endpoints); });
+    }
+
+    auto connect_deadline = connect_start + options.connect_timeout;
+    while (run.ready.load(std::memory_order_acquire) < options.connections
+        && std::chrono::steady_clock::now() < connect_deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+    std::size_t ready = run.ready.load(std::memory_order_acquire);
+    double connect_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - connect_start).count();
+    LOG_INFO("load: connections={}/{}, connect_seconds={:.3f}, connects/s={:.0f}",
+        ready, options.connections, connect_seconds, ready / connect_seconds);
+
+    // Let the joins settle before any message is sent.
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    run.sending.store(true, std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < connections.size(); ++i)
+    {
+        load_connection* connection = connections[i].get();
+        asio::post(*contexts[i % options.threads], [connection]() { connection->start(); });
+    }
+
+    std::this_thread::sleep_for(options.duration);
+    run.sending.store(false, std::memory_order_relaxed);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Give messages still in flight a moment to arrive.
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    // Closing cancels every connection's timer and socket, so each io_context
+    // runs out of work once their handlers have run.
+    for (std::size_t i = 0; i < connections.size(); ++i)
+    {
+        load_connection* connection = connections[i].get();
+        asio::post(*contexts[i % options.threads], [connection]() { connection->close(); });
+    }
+    work.clear();
+    for (auto& t : threads)
+        t.join();
+
+    load_stats total;
+    for (const auto& s : stats)
+    {
+        total.latency.merge(s.latency);
+        total.sent += s.sent;
+        total.delivered += s.delivered;
+        total.echoed += s.echoed;
+        total.timeouts += s.timeouts;
+    }
+
+    LOG_INFO("load: seconds={:.1f}, sent={}, sent/s={:.0f}, delivered={}, delivered/s={:.0f}, lost={}, echo_timeouts={}",
+        seconds, total.sent, total.sent / seconds, total.delivered, total.delivered / seconds,
+        total.sent - std::min(total.sent, total.echoed), total.timeouts);
+    LOG_INFO("load: latency_us p50={:.1f} p99={:.1f} p999={:.1f} max={:.1f}",
+        total.latency.percentile(0.50) / 1e3, total.latency.percentile(0.99) / 1e3,
+        total.latency.percentile(0.999) / 1e3, total.latency.max() / 1e3);
+}
+
 int main(int argc, char* argv[])
 {
     spdlog_default_initialize();
 
     try
     {
-        LOG_INFO("input port : ");
-        std::string port;
-        std::cin >> port;
+        // Usage: Example_ChatClient [--host=name] [--port=N] [--legacy]
+        // --host defaults to 127.0.0.1. --legacy skips the binary framing
+        // negotiation, for servers that predate it.
+        //
+        // Lines are sent as chat messages to the current room, 0 to begin with.
+        // "/join N" and "/leave N" change membership of room N and "/room N"
+        // makes N the current room. Rooms other than 0 need binary framing.
+        //
+        // Load generator: Example_ChatClient --load [--host=name] [--port=N] [--connections=N]
+        //     [--threads=N] [--rate=msgs/s] [--duration=seconds] [--body-bytes=N]
+        //     [--rooms=N] [--echo-timeout-ms=N] [--legacy]
+        // --rate is per connection; without it each connection runs closed-loop,
+        // sending its next message once the last one is back or
+        // --echo-timeout-ms (default 1000) has passed. Messages that never
+        // come back are reported as lost.
+        // --threads=0, the default, uses one io_context per hardware thread.
+        command_line args(argc, argv);
+
+        std::string port = args.get<std::string>("port", "");
+        if (port.empty())
+        {
+            LOG_INFO("input port : ");
+            std::cin >> port;
+        }
 
         asio::io_context io_context;
 
         tcp::resolver resolver(io_context);
-        auto endpoints = resolver.resolve("127.0.0.1", port);
-        chat_client c(io_context, endpoints);
+        auto endpoints = resolver.resolve(args.get<std::string>("host", "127.0.0.1"), port);
+
+        if (args.get("load", false))
+        {
+            // Per-message debug logging would swamp the measurement.
+            spdlog::set_level(spdlog::level::info);
+
+            load_options options;
+            options.connections = std::max<std::size_t>(1, args.get("connections", options.connections));
+            options.threads = args.get<std::size_t>("threads", 0);
+            if (options.threads == 0)
+                options.threads = std::max(1u, std::thread::hardware_concurrency());
+            options.rate = args.get("rate", options.rate);
+            options.echo_timeout = std::chrono::milliseconds(std::max<std::int64_t>(1,
+                args.get<std::int64_t>("echo-timeout-ms", options.echo_timeout.count())));
+            options.duration = std::chrono::seconds(args.get<std::int64_t>("duration", options.duration.count()));
+            options.body_bytes = args.get("body-bytes", options.body_bytes);
+            options.rooms = args.get("rooms", options.rooms);
+            options.legacy = args.get("legacy", false);
+
+            run_load(endpoints, options);
+            return 0;
+        }
+
+        chat_client c(io_context, endpoints, args.get("legacy", false));
 
         std::thread t([&io_context]() { io_context.run(); });
 
-        char line[chat_message::max_body_length + 1];
-        while (std::cin.getline(line, chat_message::max_body_length + 1))
+        std::uint32_t room = 0;
+        std::string line;
+        while (std::getline(std::cin, line))
         {
             chat_message msg;
-            msg.body_length(std::strlen(line));
-            std::memcpy(msg.body(), line, msg.body_length());
+            msg.room_id(room);
+
+            std::string_view command(line);
+            std::uint32_t id = 0;
+            auto parse_id = [&](std::string_view prefix)
+            {
+                if (command.substr(0, prefix.size()) != prefix)
+                    return false;
+                auto arg = command.substr(prefix.size());
+                auto result = std::from_chars(arg.data(), arg.data() + arg.size(), id);
+                return result.ec == std::errc() && result.ptr == arg.data() + arg.size();
+            };
+
+            if (parse_id("/room "))
+            {
+                room = id;
+                continue;
+            }
+            else if (parse_id("/join "))
+            {
+                msg.type(chat_message_type::join);
+                msg.room_id(id);
+            }
+            else if (parse_id("/leave "))
+            {
+                msg.type(chat_message_type::leave);
+                msg.room_id(id);
+            }
+            else
+            {
+                msg.body_length(line.size());
+                std::memcpy(msg.body(), line.data(), msg.body_length());
+            }
+
             msg.encode_header();
-            c.write(msg);
+            c.write(std::move(msg));
         }
 
         c.close();
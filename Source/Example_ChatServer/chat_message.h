@@ -0,0 +1,558 @@
+//
+// chat_message.h
+// ~~~~~~~~~~~~~~
+//
+// Copyright (c) 2003-2021 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+
+// Framing used on a connection.
+//
+// legacy: a 4 character, space padded decimal body length ("%4d") followed by
+//         at most 512 body bytes. This is what the original samples speak.
+//
+// binary: a 12 byte little-endian header followed by the body:
+//           0..3   body length
+//           4..7   room id
+//           8      message type
+//           9      flags
+//           10..11 reserved, zero
+//
+// A client asks for the binary framing by sending chat_preamble as the first 4
+// bytes of the connection. The first byte can never start a legacy header, so
+// the server can tell the two apart. The server answers with its own preamble
+// at the point in its output stream where it switches to binary frames; any
+// frames it sent before that are legacy.
+enum class wire_format : std::uint8_t
+{
+    legacy,
+    binary
+};
+
+// Legacy frames are always chat messages for room 0. join and leave carry no
+// body, and a header giving them one does not decode; they subscribe the
+// sender to, or unsubscribe it from, the room named in the header and are not
+// forwarded to anyone.
+enum class chat_message_type : std::uint8_t
+{
+    chat = 0,
+    join = 1,
+    leave = 2
+};
+
+namespace chat_preamble
+{
+    enum { length = 4 };
+
+    // Highest binary framing version this build speaks.
+    constexpr std::uint8_t version = 1;
+
+    inline void encode(char* data, std::uint8_t protocol_version)
+    {
+        data[0] = static_cast<char>(0xC5);
+        data[1] = 'C';
+        data[2] = 'H';
+        data[3] = static_cast<char>(protocol_version);
+    }
+
+    // Returns the version the peer asked for, or 0 if data is not a preamble.
+    inline std::uint8_t decode(const char* data)
+    {
+        bool magic = static_cast<unsigned char>(data[0]) == 0xC5 && data[1] == 'C' && data[2] == 'H';
+        return magic ? static_cast<std::uint8_t>(data[3]) : 0;
+    }
+}
+
+// Size-classed slab allocator for message storage. Blocks come from 64 KiB (or
+// larger) slabs carved into one size class each, and freed blocks go onto a
+// per-thread free list, spilling to a shared list in batches when it grows
+// long. A message freed on another shard's thread simply stocks that thread's
+// cache. Requests above the largest class go to the global heap.
+//
+// Slabs are never handed back to the heap, so the pool's footprint is bounded
+// by the peak number of messages in flight, not by traffic.
+class message_pool
+{
+public:
+    enum { class_count = 5 };
+    static constexpr std::size_t class_sizes[class_count] = { 64, 256, 1024, 4096, 64 * 1024 };
+
+    // Returns a block of at least size bytes and sets capacity to its real size,
+    // which must be passed back to deallocate().
+    static void* allocate(std::size_t size, std::size_t& capacity)
+    {
+        std::size_t index = class_index(size);
+        if (index == class_count)
+        {
+            capacity = size;
+            return ::operator new(size);
+        }
+
+        capacity = class_sizes[index];
+        thread_cache& cache = local_cache();
+        if (cache.head[index] == nullptr)
+            refill(cache, index);
+
+        free_block* block = cache.head[index];
+        cache.head[index] = block->next;
+        --cache.count[index];
+        return block;
+    }
+
+    static void deallocate(void* pointer, std::size_t capacity)
+    {
+        std::size_t index = class_index(capacity);
+        if (index == class_count)
+        {
+            ::operator delete(pointer);
+            return;
+        }
+
+        thread_cache& cache = local_cache();
+        free_block* block = static_cast<free_block*>(pointer);
+        block->next = cache.head[index];
+        cache.head[index] = block;
+        if (++cache.count[index] > cache_limit(index))
+            spill(cache, index, cache_limit(index) / 2);
+    }
+
+    // Bytes reserved in slabs so far, across all classes.
+    static std::size_t reserved_bytes()
+    {
+        return shared().reserved.load(std::memory_order_relaxed);
+    }
+
+    // Times a thread cache has taken the shared list's mutex to refill or
+    // spill. Blocks allocated on one thread and freed on another pass
+    // through the shared list, half a cache's worth per lock.
+    static std::uint64_t shared_locks()
+    {
+        return shared().locks.load(std::memory_order_relaxed);
+    }
+
+private:
+    enum { slab_bytes = 64 * 1024 };
+
+    struct free_block
+    {
+        free_block* next;
+    };
+
+    struct thread_cache
+    {
+        free_block* head[class_count] = {};
+        std::size_t count[class_count] = {};
+
+        ~thread_cache()
+        {
+            for (std::size_t i = 0; i < class_count; ++i)
+                spill(*this, i, count[i]);
+        }
+    };
+
+    struct shared_pool
+    {
+        std::mutex mutex;
+        free_block* head[class_count] = {};
+        std::atomic<std::size_t> reserved{ 0 };
+        std::atomic<std::uint64_t> locks{ 0 };
+    };
+
+    static std::size_t class_index(std::size_t size)
+    {
+        std::size_t index = 0;
+        while (index < class_count && class_sizes[index] < size)
+            ++index;
+        return index;
+    }
+
+    // Keep up to about 256 KiB of free blocks per class in each thread.
+    static std::size_t cache_limit(std::size_t index)
+    {
+        return std::max<std::size_t>(8, 256 * 1024 / class_sizes[index]);
+    }
+
+    static thread_cache& local_cache()
+    {
+        thread_local thread_cache cache;
+        return cache;
+    }
+
+    static shared_pool& shared()
+    {
+        static shared_pool pool;
+        return pool;
+    }
+
+    // Move up to half a cache's worth of blocks from the shared list, or carve
+    // a new slab if the shared list is empty.
+    static void refill(thread_cache& cache, std::size_t index)
+    {
+        shared_pool& pool = shared();
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            pool.locks.fetch_add(1, std::memory_order_relaxed);
+            std::size_t wanted = cache_limit(index) / 2;
+            while (pool.head[index] != nullptr && cache.count[index] < wanted)
+            {
+                free_block* block = pool.head[index];
+                pool.head[index] = block->next;
+                block->next = cache.head[index];
+                cache.head[index] = block;
+                ++cache.count[index];
+            }
+        }
+        if (cache.head[index] != nullptr)
+            return;
+
+        std::size_t block_size = class_sizes[index];
+        std::size_t bytes = std::max<std::size_t>(slab_bytes, block_size * 4);
+        char* slab = static_cast<char*>(::operator new(bytes));
+        pool.reserved.fetch_add(bytes, std::memory_order_relaxed);
+        for (std::size_t offset = 0; offset + block_size <= bytes; offset += block_size)
+        {
+            free_block* block = reinterpret_cast<free_block*>(slab + offset);
+            block->next = cache.head[index];
+            cache.head[index] = block;
+            ++cache.count[index];
+        }
+    }
+
+    static void spill(thread_cache& cache, std::size_t index, std::size_t n)
+    {
+        if (n == 0)
+            return;
+
+        shared_pool& pool = shared();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.locks.fetch_add(1, std::memory_order_relaxed);
+        for (; n != 0 && cache.head[index] != nullptr; --n)
+        {
+            free_block* block = cache.head[index];
+            cache.head[index] = block->next;
+            --cache.count[index];
+            block->next = pool.head[index];
+            pool.head[index] = block;
+        }
+    }
+};
+
+// Minimal allocator over message_pool, used to put a message and its
+// shared_ptr control block in one pooled block.
+template <typename T>
+class message_pool_allocator
+{
+public:
+    using value_type = T;
+
+    message_pool_allocator() noexcept = default;
+
+    template <typename U>
+    message_pool_allocator(const message_pool_allocator<U>&) noexcept
+    {
+    }
+
+    bool operator==(const message_pool_allocator&) const noexcept
+    {
+        return true;
+    }
+
+    bool operator!=(const message_pool_allocator&) const noexcept
+    {
+        return false;
+    }
+
+    T* allocate(std::size_t n) const
+    {
+        std::size_t capacity;
+        return static_cast<T*>(message_pool::allocate(sizeof(T) * n, capacity));
+    }
+
+    void deallocate(T* p, std::size_t n) const
+    {
+        message_pool::deallocate(p, sizeof(T) * n);
+    }
+};
+
+// Decoded form of either header encoding.
+struct chat_header
+{
+    std::uint32_t body_length = 0;
+    std::uint32_t room_id = 0;
+    chat_message_type type = chat_message_type::chat;
+    std::uint8_t flags = 0;
+};
+
+class chat_message
+{
+public:
+    enum { legacy_header_length = 4 };
+    enum { binary_header_length = 12 };
+    enum { legacy_max_body_length = 512 };
+    enum { max_body_length = 16 * 1024 * 1024 };
+
+    static std::size_t header_length(wire_format format)
+    {
+        return format == wire_format::binary
+            ? static_cast<std::size_t>(binary_header_length)
+            : static_cast<std::size_t>(legacy_header_length);
+    }
+
+    // Decode a header of the given format. data must hold header_length(format)
+    // bytes. Neither decoder uses the C string functions: the legacy one parses
+    // the digits directly and the binary one only shifts bytes.
+    static bool decode_header(wire_format format, const char* data, chat_header& header)
+    {
+        return format == wire_format::binary
+            ? decode_binary_header(data, header)
+            : decode_legacy_header(data, header);
+    }
+
+    chat_message()
+        : data_(nullptr),
+        capacity_(0)
+    {
+        allocate(0);
+        encode_header();
+    }
+
+    explicit chat_message(const chat_header& header)
+        : header_(header),
+        data_(nullptr),
+        capacity_(0)
+    {
+        allocate(header.body_length);
+        encode_header();
+    }
+
+    // Messages own pooled storage sized to their body, so they are move-only;
+    // share them through a chat_message_ptr instead of copying.
+    chat_message(const chat_message&) = delete;
+    chat_message& operator=(const chat_message&) = delete;
+
+    chat_message(chat_message&& other) noexcept
+        : header_(other.header_),
+        data_(std::exchange(other.data_, nullptr)),
+        capacity_(std::exchange(other.capacity_, 0))
+    {
+        std::memcpy(legacy_header_, other.legacy_header_, legacy_header_length);
+    }
+
+    chat_message& operator=(chat_message&& other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            header_ = other.header_;
+            data_ = std::exchange(other.data_, nullptr);
+            capacity_ = std::exchange(other.capacity_, 0);
+            std::memcpy(legacy_header_, other.legacy_header_, legacy_header_length);
+        }
+        return *this;
+    }
+
+    ~chat_message()
+    {
+        release();
+    }
+
+    // The message framed in the binary format: header then body, contiguous.
+    const char* data() const
+    {
+        return data_;
+    }
+
+    std::size_t length() const
+    {
+        return binary_header_length + body_length();
+    }
+
+    // The legacy header for the same body. Only valid for bodies of at most
+    // legacy_max_body_length bytes.
+    const char* legacy_header() const
+    {
+        return legacy_header_;
+    }
+
+    bool fits_legacy() const
+    {
+        return body_length() <= legacy_max_body_length;
+    }
+
+    std::size_t length(wire_format format) const
+    {
+        return header_length(format) + body_length();
+    }
+
+    const char* body() const
+    {
+        return data_ + binary_header_length;
+    }
+
+    char* body()
+    {
+        return data_ + binary_header_length;
+    }
+
+    std::size_t body_length() const
+    {
+        return header_.body_length;
+    }
+
+    void body_length(std::size_t new_length)
+    {
+        if (new_length > max_body_length)
+            new_length = max_body_length;
+        if (binary_header_length + new_length > capacity_)
+        {
+            // Moving to a larger size class keeps the bytes already written.
+            char* old_data = data_;
+            std::size_t old_capacity = capacity_;
+            allocate(new_length);
+            std::memcpy(data_, old_data, binary_header_length + std::min<std::size_t>(body_length(), new_length));
+            message_pool::deallocate(old_data, old_capacity);
+        }
+        header_.body_length = static_cast<std::uint32_t>(new_length);
+    }
+
+    const chat_header& header() const
+    {
+        return header_;
+    }
+
+    std::uint32_t room_id() const
+    {
+        return header_.room_id;
+    }
+
+    void room_id(std::uint32_t id)
+    {
+        header_.room_id = id;
+    }
+
+    chat_message_type type() const
+    {
+        return header_.type;
+    }
+
+    void type(chat_message_type new_type)
+    {
+        header_.type = new_type;
+    }
+
+    // Write both header encodings for the current body length, room, type and
+    // flags. Called once before the message is shared.
+    void encode_header()
+    {
+        char* h = data_;
+        store_le32(h, header_.body_length);
+        store_le32(h + 4, header_.room_id);
+        h[8] = static_cast<char>(header_.type);
+        h[9] = static_cast<char>(header_.flags);
+        h[10] = 0;
+        h[11] = 0;
+
+        // "%4d" for 0..9999; longer bodies never go out in legacy framing.
+        std::uint32_t n = header_.body_length;
+        legacy_header_[3] = static_cast<char>('0' + n % 10);
+        legacy_header_[2] = n >= 10 ? static_cast<char>('0' + n / 10 % 10) : ' ';
+        legacy_header_[1] = n >= 100 ? static_cast<char>('0' + n / 100 % 10) : ' ';
+        legacy_header_[0] = n >= 1000 ? static_cast<char>('0' + n / 1000 % 10) : ' ';
+    }
+
+private:
+    void allocate(std::size_t body_length)
+    {
+        data_ = static_cast<char*>(message_pool::allocate(binary_header_length + body_length, capacity_));
+    }
+
+    void release()
+    {
+        if (data_ != nullptr)
+            message_pool::deallocate(data_, capacity_);
+        data_ = nullptr;
+        capacity_ = 0;
+    }
+
+    static void store_le32(char* data, std::uint32_t value)
+    {
+        data[0] = static_cast<char>(value);
+        data[1] = static_cast<char>(value >> 8);
+        data[2] = static_cast<char>(value >> 16);
+        data[3] = static_cast<char>(value >> 24);
+    }
+
+    static std::uint32_t load_le32(const char* data)
+    {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(data);
+        return static_cast<std::uint32_t>(u[0])
+            | static_cast<std::uint32_t>(u[1]) << 8
+            | static_cast<std::uint32_t>(u[2]) << 16
+            | static_cast<std::uint32_t>(u[3]) << 24;
+    }
+
+    static bool decode_binary_header(const char* data, chat_header& header)
+    {
+        header.body_length = load_le32(data);
+        header.room_id = load_le32(data + 4);
+        header.type = static_cast<chat_message_type>(data[8]);
+        header.flags = static_cast<std::uint8_t>(data[9]);
+
+        bool valid = (header.body_length <= max_body_length)
+            & (static_cast<std::uint8_t>(data[8]) <= static_cast<std::uint8_t>(chat_message_type::leave))
+            & (header.type == chat_message_type::chat || header.body_length == 0)
+            & ((data[10] | data[11]) == 0);
+        if (!valid)
+            header.body_length = 0;
+        return valid;
+    }
+
+    // Accepts what "%4d" produces: leading spaces, then digits to the end.
+    static bool decode_legacy_header(const char* data, chat_header& header)
+    {
+        std::uint32_t value = 0;
+        bool digits = false;
+        bool valid = true;
+        for (int i = 0; i < legacy_header_length; ++i)
+        {
+            unsigned digit = static_cast<unsigned char>(data[i]) - '0';
+            bool is_digit = digit < 10;
+            bool is_space = data[i] == ' ' && !digits;
+            valid &= is_digit | is_space;
+            digits |= is_digit;
+            value = is_digit ? value * 10 + digit : value;
+        }
+
+        valid &= value <= legacy_max_body_length;
+        header = chat_header();
+        header.body_length = valid ? value : 0;
+        return valid;
+    }
+
+    chat_header header_;
+
+    // Binary header followed by the body, in a block from message_pool.
+    char* data_;
+    std::size_t capacity_;
+
+    char legacy_header_[legacy_header_length];
+};
+
+// Build a message whose object and reference count share one pooled block.
+inline std::shared_ptr<chat_message> make_chat_message(const chat_header& header)
+{
+    return std::allocate_shared<chat_message>(message_pool_allocator<chat_message>(), header);
+}
@@ -0,0 +1,356 @@
+//
+// chat_room.h
+// ~~~~~~~~~~~
+//
+// Copyright (c) 2003-2021 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#pragma once
+#include <LibInclude.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+#include "chat_message.h"
+
+// Messages are encoded once when they are read and then shared, immutable, by
+// the room history and every session they are queued on.
+typedef std::shared_ptr<const chat_message> chat_message_ptr;
+typedef std::deque<chat_message_ptr> chat_message_queue;
+
+// A room's recent messages, bounded both by count and by total frame bytes.
+// The slots are one contiguous array allocated on the first push, so a room
+// that never sees traffic costs nothing and a busy one never reallocates.
+// Oldest messages are evicted first.
+class history_ring
+{
+public:
+    history_ring(std::size_t max_msgs, std::size_t max_bytes)
+        : max_msgs_(max_msgs),
+        max_bytes_(max_bytes),
+        head_(0),
+        size_(0),
+        bytes_(0)
+    {
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    // Total binary frame length of the messages held.
+    std::size_t bytes() const
+    {
+        return bytes_;
+    }
+
+    void push(chat_message_ptr msg)
+    {
+        if (max_msgs_ == 0)
+            return;
+        if (slots_.empty())
+            slots_.resize(max_msgs_);
+
+        if (size_ == max_msgs_)
+            pop();
+
+        bytes_ += msg->length();
+        slots_[index(size_)] = std::move(msg);
+        ++size_;
+
+        while (bytes_ > max_bytes_ && size_ != 0)
+            pop();
+    }
+
+    // The messages held, oldest first. The second span is empty unless the
+    // history wraps around the end of the slots.
+    std::array<std::span<const chat_message_ptr>, 2> spans() const
+    {
+        std::size_t first = std::min(size_, slots_.size() - head_);
+        return { {
+            std::span<const chat_message_ptr>(slots_.data() + head_, first),
+            std::span<const chat_message_ptr>(slots_.data(), size_ - first) } };
+    }
+
+private:
+    std::size_t index(std::size_t n) const
+    {
+        std::size_t i = head_ + n;
+        return i < slots_.size() ? i : i - slots_.size();
+    }
+
+    void pop()
+    {
+        bytes_ -= slots_[head_]->length();
+        slots_[head_].reset();
+        head_ = index(1);
+        --size_;
+    }
+
+    std::size_t max_msgs_;
+    std::size_t max_bytes_;
+    std::vector<chat_message_ptr> slots_;
+    std::size_t head_;
+    std::size_t size_;
+    std::size_t bytes_;
+};
+
+//----------------------------------------------------------------------
+
+class chat_participant
+{
+public:
+    virtual ~chat_participant() {}
+    virtual void deliver(const chat_message_ptr& msg) = 0;
+
+    // Called once on joining a room that has history, with all of it.
+    virtual void deliver_history(const history_ring& history) = 0;
+
+    // Called when the room lifts a read pause this participant was parked on.
+    virtual void resume_reading() {}
+};
+
+typedef std::shared_ptr<chat_participant> chat_participant_ptr;
+
+//----------------------------------------------------------------------
+
+// The participants of one room. Members are stored contiguously so that a
+// broadcast walks a flat array of pointers; an open-addressing table maps each
+// participant to its position in that array, which makes insert and erase
+// O(1). Erasing moves the last member into the hole, so iteration order is not
+// stable across leaves.
+class participant_set
+{
+public:
+    typedef std::vector<chat_participant_ptr>::const_iterator const_iterator;
+
+    const_iterator begin() const
+    {
+        return members_.begin();
+    }
+
+    const_iterator end() const
+    {
+        return members_.end();
+    }
+
+    std::size_t size() const
+    {
+        return members_.size();
+    }
+
+    bool empty() const
+    {
+        return members_.empty();
+    }
+
+    // Returns false if the participant is already a member.
+    bool insert(chat_participant_ptr participant)
+    {
+        // Keep the table at most half full.
+        if ((members_.size() + 1) * 2 > slots_.size())
+            rehash(std::max<std::size_t>(slots_.size() * 2, 16));
+
+        std::size_t slot = find(participant.get());
+        if (slots_[slot] != empty_slot)
+            return false;
+
+        slots_[slot] = static_cast<std::uint32_t>(members_.size());
+        members_.push_back(std::move(participant));
+        return true;
+    }
+
+    // Returns false if the participant is not a member.
+    bool erase(const chat_participant* participant)
+    {
+        if (members_.empty())
+            return false;
+
+        std::size_t slot = find(participant);
+        if (slots_[slot] == empty_slot)
+            return false;
+
+        // Move the last member into the vacated position.
+        std::uint32_t index = slots_[slot];
+        std::uint32_t last = static_cast<std::uint32_t>(members_.size() - 1);
+        if (index != last)
+        {
+            slots_[find(members_[last].get())] = index;
+            members_[index] = std::move(members_[last]);
+        }
+        members_.pop_back();
+
+        // Backward-shift deletion: pull later entries of the probe run into the
+        // hole so lookups never need tombstones.
+        std::size_t mask = slots_.size() - 1;
+        std::size_t hole = slot;
+        for (std::size_t next = (hole + 1) & mask; slots_[next] != empty_slot; next = (next + 1) & mask)
+        {
+            std::size_t home = hash(members_[slots_[next]].get()) & mask;
+            if (((next - home) & mask) >= ((next - hole) & mask))
+            {
+                slots_[hole] = slots_[next];
+                hole = next;
+            }
+        }
+        slots_[hole] = empty_slot;
+        return true;
+    }
+
+private:
+    static constexpr std::uint32_t empty_slot = ~std::uint32_t(0);
+
+    static std::size_t hash(const chat_participant* participant)
+    {
+        // Fibonacci hashing of the address; the low bits are alignment.
+        std::uint64_t key = reinterpret_cast<std::uintptr_t>(participant) >> 4;
+        return static_cast<std::size_t>((key * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    // The slot holding participant, or the empty slot where it would go.
+    std::size_t find(const chat_participant* participant) const
+    {
+        std::size_t mask = slots_.size() - 1;
+        std::size_t slot = hash(participant) & mask;
+        while (slots_[slot] != empty_slot && members_[slots_[slot]].get() != participant)
+            slot = (slot + 1) & mask;
+        return slot;
+    }
+
+    void rehash(std::size_t slot_count)
+    {
+        slots_.assign(slot_count, empty_slot);
+        for (std::uint32_t i = 0; i < members_.size(); ++i)
+            slots_[find(members_[i].get())] = i;
+    }
+
+    std::vector<chat_participant_ptr> members_;
+    std::vector<std::uint32_t> slots_;
+};
+
+//----------------------------------------------------------------------
+
+struct chat_room_options
+{
+    // Bounds on the history a room replays to a participant that joins it.
+    std::size_t history_msgs = 100;
+    std::size_t history_bytes = 1024 * 1024;
+
+    // A shard reclaims its replica of a room, history and all, once the room
+    // has had no participants on that shard and no messages for between one
+    // and two of these. Zero keeps every room for the life of the server.
+    std::chrono::seconds idle_timeout{ 60 };
+};
+
+class chat_room
+{
+public:
+    chat_room(std::uint32_t id, const chat_room_options& options)
+        : id_(id),
+        recent_msgs_(options.history_msgs, options.history_bytes),
+        used_(true)
+    {
+    }
+
+    chat_room(const chat_room&) = delete;
+    chat_room& operator=(const chat_room&) = delete;
+
+    std::uint32_t id() const
+    {
+        return id_;
+    }
+
+    std::size_t size() const
+    {
+        return participants_.size();
+    }
+
+    void join(chat_participant_ptr participant)
+    {
+        LOG_INFO("Room join room={}, id={}", id_, fmt::ptr(participant.get()));
+        used_ = true;
+        if (!participants_.insert(participant))
+            return;
+        if (!recent_msgs_.empty())
+            participant->deliver_history(recent_msgs_);
+    }
+
+    void leave(const chat_participant* participant)
+    {
+        used_ = true;
+        participants_.erase(participant);
+    }
+
+    void deliver(const chat_message_ptr& msg)
+    {
+        used_ = true;
+        recent_msgs_.push(msg);
+
+        for (const auto& participant : participants_)
+            participant->deliver(msg);
+    }
+
+    // Flow control for the pause_reader overflow policy. While any participant
+    // is congested, sessions in the room stop issuing reads and park here; the
+    // last congested participant to drain wakes them all up. Only producers on
+    // this shard are paused, messages from other shards keep arriving.
+    void pause_readers()
+    {
+        ++congested_;
+    }
+
+    void resume_readers()
+    {
+        if (--congested_ != 0)
+            return;
+
+        auto parked = std::move(parked_readers_);
+        parked_readers_.clear();
+        for (const auto& participant : parked)
+            participant->resume_reading();
+    }
+
+    bool readers_paused() const
+    {
+        return congested_ != 0;
+    }
+
+    void park_reader(chat_participant_ptr participant)
+    {
+        parked_readers_.push_back(std::move(participant));
+    }
+
+    // Called by each sweep of the shard's rooms. True if nothing has joined,
+    // left or delivered to the room since the previous sweep and nothing
+    // refers to it any more, so it can be destroyed.
+    bool sweep_idle()
+    {
+        bool idle = !used_ && participants_.empty() && congested_ == 0 && parked_readers_.empty();
+        used_ = false;
+        return idle;
+    }
+
+private:
+    std::uint32_t id_;
+    participant_set participants_;
+    history_ring recent_msgs_;
+    std::size_t congested_ = 0;
+    std::vector<chat_participant_ptr> parked_readers_;
+    bool used_;
+};
@@ -9,242 +9,987 @@
 //
 
 #include <LibInclude.h>
+#include <async_log.h>
+#include <byte_ring.h>
+#include <command_line.h>
+#include <io_backend.h>
+#include <io_locking.h>
+#include <periodic_scheduler.h>
+#include <syscall_counter.h>
+#include <timing_wheel.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
-#include <deque>
 #include <iostream>
 #include <list>
 #include <memory>
-#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include <asio/asio.hpp>
+#include "chat_message.h"
+#include "chat_room.h"
 
 using asio::ip::tcp;
 
+// Debug lines a second per statement on the per-message paths. A message to a
+// large room is written once per participant, so unlimited they would bury
+// everything else and saturate the console.
+constexpr std::uint64_t message_log_rate = 100;
+
 //----------------------------------------------------------------------
-#include <cstdio>
-#include <cstdlib>
-#include <cstring>
 
-class chat_message
+// A non-owning view over a run of const_buffers. async_write copies its buffer
+// sequence into the operation, so handing it this view instead of the vector
+// itself keeps a gathered write from allocating a copy of the vector. The
+// referenced messages are kept alive by the session's write queue.
+class const_buffer_span
 {
 public:
-    enum { header_length = 4 };
-    enum { max_body_length = 512 };
+    const_buffer_span(const asio::const_buffer* begin, const asio::const_buffer* end)
+        : begin_(begin),
+        end_(end)
+    {
+    }
 
-    chat_message()
-        : body_length_(0)
+    // Implement the ConstBufferSequence requirements.
+    typedef asio::const_buffer value_type;
+    typedef const asio::const_buffer* const_iterator;
+    const asio::const_buffer* begin() const
+    {
+        return begin_;
+    }
+    const asio::const_buffer* end() const
     {
+        return end_;
     }
 
-    const char* data() const
+private:
+    const asio::const_buffer* begin_;
+    const asio::const_buffer* end_;
+};
+
+//----------------------------------------------------------------------
+
+class chat_shard_group;
+
+// One io_context and the thread that runs it. Every shard owns a replica of
+// each chat room that only holds the participants accepted onto that shard, so
+// room state is only ever touched from the shard's own thread. The same goes
+// for the timing wheel that times the shard's sessions, and for its sockets,
+// which is what lets the io_context run without locks (see io_locking.h).
+// Other threads reach the shard only through its mailbox.
+class chat_shard
+{
+public:
+    chat_shard(chat_shard_group& group, std::size_t index, const chat_room_options& room_options,
+        std::chrono::milliseconds timer_tick, io_locking locking)
+        : group_(group),
+        index_(index),
+        room_options_(room_options),
+        io_context_(concurrency_hint(locking)),
+        mailbox_(io_context_, locking),
+        timers_(io_context_, timer_tick),
+        room_sweep_(timers_, [this]() { sweep_rooms(); }),
+        work_(asio::make_work_guard(io_context_)),
+        sessions_(0),
+        messages_read_(0)
     {
-        return data_;
     }
 
-    char* data()
+    chat_shard(const chat_shard&) = delete;
+    chat_shard& operator=(const chat_shard&) = delete;
+
+    asio::io_context& io_context()
     {
-        return data_;
+        return io_context_;
     }
 
-    std::size_t length() const
+    // The way in from other threads.
+    io_mailbox& mailbox()
     {
-        return header_length + body_length_;
+        return mailbox_;
     }
 
-    const char* body() const
+    timing_wheel& timers()
     {
-        return data_ + header_length;
+        return timers_;
     }
 
-    char* body()
+    // The replica of a room, created on first use. Replicas are also created
+    // for messages arriving from other shards, so that every shard keeps the
+    // same history for a late joiner. Room ids are chosen by clients, so
+    // replicas left idle are reclaimed by sweep_rooms().
+    chat_room& room(std::uint32_t id)
     {
-        return data_ + header_length;
+        auto& room = rooms_[id];
+        if (!room)
+            room = std::make_unique<chat_room>(id, room_options_);
+        return *room;
     }
 
-    std::size_t body_length() const
+    std::size_t index() const
     {
-        return body_length_;
+        return index_;
     }
 
-    void body_length(std::size_t new_length)
+    // Number of sessions currently assigned to this shard. Read by the acceptor
+    // thread for least-load balancing, so it is only approximately current.
+    std::size_t load() const
     {
-        body_length_ = new_length;
-        if (body_length_ > max_body_length)
-            body_length_ = max_body_length;
+        return sessions_.load(std::memory_order_relaxed);
     }
 
-    bool decode_header()
+    void session_opened()
     {
-        char header[header_length + 1] = "";
-        std::strncat(header, data_, header_length);
-        body_length_ = std::atoi(header);
-        if (body_length_ > max_body_length)
-        {
-            body_length_ = 0;
-            return false;
-        }
-        return true;
+        sessions_.fetch_add(1, std::memory_order_relaxed);
     }
 
-    void encode_header()
+    void session_closed()
     {
-        char header[header_length + 1] = "";
-        std::sprintf(header, "%4d", static_cast<int>(body_length_));
-        std::memcpy(data_, header, header_length);
+        sessions_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Number of messages read by this shard's sessions. Only the shard's own
+    // thread counts them, so counting needs no atomic read-modify-write.
+    std::uint64_t messages_read() const
+    {
+        return messages_read_.load(std::memory_order_relaxed);
+    }
+
+    // Deliver a message read by one of this shard's sessions to every replica
+    // of its room. Each room has an owner shard, room_id % shards, and all of
+    // the room's messages go through it: the owner delivers them to its own
+    // replica and forwards them to the other shards in that one order, so
+    // every replica's participants and history see the same sequence, as with
+    // a single io_context. A message read on another shard takes one extra
+    // mailbox hop to reach the owner.
+    void deliver(const chat_message_ptr& msg);
+
+    // Owner shard only: deliver to the local replica and forward to the rest.
+    void fan_out(const chat_message_ptr& msg);
+
+    // Deliver a message to this shard's replica of its room only.
+    void deliver_local(const chat_message_ptr& msg)
+    {
+        room(msg->room_id()).deliver(msg);
+    }
+
+    void run()
+    {
+        // The wheel is only used from its shard's thread, which this is.
+        if (room_options_.idle_timeout.count() > 0)
+            room_sweep_.expires_after(room_options_.idle_timeout);
+        io_context_.run();
+    }
+
+    void stop()
+    {
+        work_.reset();
+        io_context_.stop();
     }
 
 private:
-    char data_[header_length + max_body_length];
-    std::size_t body_length_;
-};
+    // Destroy the replicas that have been empty and unused since the previous
+    // sweep, one idle_timeout ago.
+    void sweep_rooms()
+    {
+        std::size_t reclaimed = std::erase_if(rooms_, [](auto& entry) { return entry.second->sweep_idle(); });
+        if (reclaimed != 0)
+            LOG_DEBUG("idle rooms reclaimed. shard={}, count={}, rooms={}", index_, reclaimed, rooms_.size());
+        room_sweep_.expires_after(room_options_.idle_timeout);
+    }
 
-typedef std::deque<chat_message> chat_message_queue;
+    chat_shard_group& group_;
+    std::size_t index_;
+    chat_room_options room_options_;
+    asio::io_context io_context_;
+    io_mailbox mailbox_;
+    timing_wheel timers_;
+    wheel_timer room_sweep_;
+    asio::executor_work_guard<asio::io_context::executor_type> work_;
+    std::unordered_map<std::uint32_t, std::unique_ptr<chat_room>> rooms_;
+    std::atomic<std::size_t> sessions_;
+    std::atomic<std::uint64_t> messages_read_;
+};
 
-//----------------------------------------------------------------------
+enum class shard_balance
+{
+    round_robin,
+    least_load
+};
 
-class chat_participant
+// The set of shards making up one server. Shard 0 runs on the thread calling
+// run() and also hosts the acceptors; the others get a thread each.
+class chat_shard_group
 {
 public:
-    virtual ~chat_participant() {}
-    virtual void deliver(const chat_message& msg) = 0;
-};
+    chat_shard_group(std::size_t count, shard_balance balance, const chat_room_options& room_options,
+        std::chrono::milliseconds timer_tick, io_locking locking)
+        : balance_(balance),
+        locking_(effective_io_locking(locking)),
+        next_(0)
+    {
+        shards_.reserve(count);
+        for (std::size_t i = 0; i < count; ++i)
+            shards_.push_back(std::make_unique<chat_shard>(*this, i, room_options, timer_tick, locking_));
+    }
 
-typedef std::shared_ptr<chat_participant> chat_participant_ptr;
+    std::size_t size() const
+    {
+        return shards_.size();
+    }
 
-//----------------------------------------------------------------------
+    io_locking locking() const
+    {
+        return locking_;
+    }
 
-class chat_room
-{
-public:
-    void join(chat_participant_ptr participant)
+    std::uint64_t messages_read() const
+    {
+        std::uint64_t total = 0;
+        for (auto& shard : shards_)
+            total += shard->messages_read();
+        return total;
+    }
+
+    chat_shard& shard(std::size_t index)
+    {
+        return *shards_[index];
+    }
+
+    // The shard that orders a room's messages.
+    chat_shard& owner(std::uint32_t room_id)
+    {
+        return *shards_[room_id % shards_.size()];
+    }
+
+    // Choose the shard for a newly accepted connection. Only called from the
+    // acceptor's thread.
+    chat_shard& pick()
     {
-        LOG_INFO("Room join id={}", fmt::ptr(participant.get()));
-        participants_.insert(participant);
-        for (auto msg : recent_msgs_)
-            participant->deliver(msg);
+        if (balance_ == shard_balance::least_load)
+        {
+            auto it = std::min_element(shards_.begin(), shards_.end(),
+                [](const auto& a, const auto& b) { return a->load() < b->load(); });
+            return **it;
+        }
+
+        chat_shard& shard = *shards_[next_];
+        next_ = (next_ + 1) % shards_.size();
+        return shard;
     }
 
-    void leave(chat_participant_ptr participant)
+    // Forward a message to every shard except its room's owner, which calls
+    // this. Each replica receives it through its shard's mailbox, which runs
+    // posts in order, so the fan-out never takes a lock on room state and
+    // keeps the owner's order. Only the message pointer is copied per shard.
+    void broadcast(const chat_shard& source, const chat_message_ptr& msg)
     {
-        participants_.erase(participant);
+        for (auto& shard : shards_)
+        {
+            if (shard.get() == &source)
+                continue;
+
+            chat_shard* target = shard.get();
+            target->mailbox().post(
+                [target, msg]()
+                {
+                    target->deliver_local(msg);
+                });
+        }
     }
 
-    void deliver(const chat_message& msg)
+    void run()
     {
-        recent_msgs_.push_back(msg);
-        while (recent_msgs_.size() > max_recent_msgs)
-            recent_msgs_.pop_front();
+        std::vector<std::thread> threads;
+        threads.reserve(shards_.size() - 1);
+        for (std::size_t i = 1; i < shards_.size(); ++i)
+            threads.emplace_back([shard = shards_[i].get()]() { shard->run(); });
+
+        shards_[0]->run();
 
-        for (auto participant : participants_)
-            participant->deliver(msg);
+        for (auto& t : threads)
+            t.join();
+    }
+
+    void stop()
+    {
+        for (auto& shard : shards_)
+            shard->stop();
     }
 
 private:
-    std::set<chat_participant_ptr> participants_;
-    enum { max_recent_msgs = 100 };
-    chat_message_queue recent_msgs_;
+    std::vector<std::unique_ptr<chat_shard>> shards_;
+    shard_balance balance_;
+    io_locking locking_;
+    std::size_t next_;
 };
 
+inline void chat_shard::deliver(const chat_message_ptr& msg)
+{
+    messages_read_.store(messages_read_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    chat_shard& owner = group_.owner(msg->room_id());
+    if (&owner == this)
+    {
+        fan_out(msg);
+        return;
+    }
+
+    owner.mailbox().post(
+        [&owner, msg]()
+        {
+            owner.fan_out(msg);
+        });
+}
+
+inline void chat_shard::fan_out(const chat_message_ptr& msg)
+{
+    deliver_local(msg);
+    group_.broadcast(*this, msg);
+}
+
 //----------------------------------------------------------------------
 
+// What a session does when a message would take its write queue past a high
+// watermark.
+enum class overflow_policy
+{
+    drop_oldest,    // queue it and drop the oldest message not yet being written
+    drop_newest,    // drop the new message
+    disconnect,     // close the slow session
+    pause_reader    // queue it and pause the readers in its rooms until the queue drains
+};
+
+// How often each overflow policy has fired, over all sessions, and how many
+// sessions their timers have closed.
+struct backpressure_stats
+{
+    std::atomic<std::uint64_t> dropped_oldest{ 0 };
+    std::atomic<std::uint64_t> dropped_newest{ 0 };
+    std::atomic<std::uint64_t> disconnects{ 0 };
+    std::atomic<std::uint64_t> pauses{ 0 };
+    std::atomic<std::uint64_t> idle_closes{ 0 };
+    std::atomic<std::uint64_t> write_timeouts{ 0 };
+};
+
+inline backpressure_stats& server_backpressure_stats()
+{
+    static backpressure_stats stats;
+    return stats;
+}
+
+struct chat_session_options
+{
+    // Upper bounds on how much of the write queue a single gathered write may
+    // take. asio hands at most 64 buffers to one sendmsg call on POSIX, so
+    // batches larger than that are split across system calls anyway.
+    std::size_t max_write_batch_msgs = 64;
+    std::size_t max_write_batch_bytes = 64 * 1024;
+
+    // Size of the per-session read-ahead ring, rounded up to a power of two.
+    // Bodies larger than the ring are read straight into the message.
+    std::size_t read_buffer_bytes = 16 * 1024;
+
+    // Largest body a client may send. A message's storage is allocated as
+    // soon as its header arrives, so without a cap a peer could make the
+    // server reserve up to chat_message::max_body_length per header sent. A
+    // frame over the cap closes the session.
+    std::size_t max_body_bytes = 64 * 1024;
+
+    // Rooms a session may be in at once, room 0 included. Each room a client
+    // names is created on every shard its messages reach; joins past the cap
+    // are ignored.
+    std::size_t max_rooms = 16;
+
+    // Write queue bounds. Going past either high watermark applies the
+    // overflow policy; a paused room resumes once the queue is back under both
+    // low watermarks. Bytes are counted as binary frame lengths.
+    std::size_t high_watermark_msgs = 4096;
+    std::size_t high_watermark_bytes = 4 * 1024 * 1024;
+    std::size_t low_watermark_msgs = 1024;
+    std::size_t low_watermark_bytes = 1024 * 1024;
+    overflow_policy overflow = overflow_policy::drop_oldest;
+
+    // A session that sends nothing for idle_timeout is closed, as is one whose
+    // write has not completed within write_timeout. Zero disables either.
+    // Both are timed on the shard's timing wheel, to within one tick.
+    std::chrono::seconds idle_timeout{ 0 };
+    std::chrono::seconds write_timeout{ 30 };
+};
+
 class chat_session
     : public chat_participant,
     public std::enable_shared_from_this<chat_session>
 {
 public:
-    chat_session(tcp::socket socket, chat_room& room)
+    chat_session(tcp::socket socket, chat_shard& shard, const chat_session_options& options)
         : socket_(std::move(socket)),
-        room_(room)
+        shard_(shard),
+        options_(options),
+        read_buffer_(std::max<std::size_t>(options.read_buffer_bytes, chat_message::binary_header_length)),
+        read_body_filled_(0),
+        read_format_(wire_format::legacy),
+        write_format_(wire_format::legacy),
+        negotiated_(false),
+        send_preamble_(false),
+        writing_(false),
+        queued_bytes_(0),
+        congested_(false),
+        disconnecting_(false),
+        stopped_(false),
+        write_batch_msgs_(0),
+        backlog_msgs_(0),
+        write_flushes_(0),
+        write_flushed_msgs_(0),
+        idle_timer_(shard.timers(), [this]() { on_idle_timer(); }),
+        write_timer_(shard.timers(), [this]() { on_write_timer(); }),
+        read_parked_(false),
+        last_read_(0)
     {
+        shard_.session_opened();
     }
 
+    ~chat_session()
+    {
+        LOG_DEBUG("session closed. id={}, flushes={}, messages={}, avg_batch={:.2f}", fmt::ptr(this),
+            write_flushes_, write_flushed_msgs_,
+            write_flushes_ ? static_cast<double>(write_flushed_msgs_) / write_flushes_ : 0.0);
+        shard_.session_closed();
+    }
+
+    // Every session starts out in room 0, the only room a legacy client can
+    // reach.
     void start()
     {
-        room_.join(shared_from_this());
-        do_read_header();
+        // Writes are already coalesced per batch; Nagle would only hold the
+        // next batch back until the peer's delayed acknowledgement.
+        std::error_code ec;
+        socket_.set_option(tcp::no_delay(true), ec);
+
+        join_room(0);
+        if (options_.idle_timeout.count() > 0)
+        {
+            last_read_ = shard_.timers().now();
+            idle_timer_.expires_after(options_.idle_timeout);
+        }
+        do_read();
     }
 
-    void deliver(const chat_message& msg)
+    void deliver(const chat_message_ptr& msg)
     {
-        bool write_in_progress = !write_msgs_.empty();
-        write_msgs_.push_back(msg);
-        if (!write_in_progress)
+        enqueue(msg);
+        if (!writing_ && !stopped_ && !disconnecting_)
         {
             do_write();
         }
     }
 
+    // The backlog is queued as a whole and, if nothing else is being written,
+    // goes out in one gathered write regardless of the batch limits.
+    void deliver_history(const history_ring& history)
+    {
+        for (const auto& span : history.spans())
+        {
+            for (const auto& msg : span)
+                enqueue(msg);
+        }
+
+        if (!writing_ && !stopped_ && !disconnecting_)
+        {
+            backlog_msgs_ = write_msgs_.size();
+            do_write();
+        }
+    }
+
+    // The wait while parked does not count as idle time.
+    void resume_reading()
+    {
+        read_parked_ = false;
+        last_read_ = shard_.timers().now();
+        if (!stopped_)
+            do_read();
+    }
+
 private:
-    void do_read_header()
+    // Add a message to the write queue, applying the overflow policy.
+    void enqueue(const chat_message_ptr& msg)
+    {
+        if (stopped_ || disconnecting_)
+            return;
+
+        backpressure_stats& stats = server_backpressure_stats();
+        bool overflow = write_msgs_.size() + 1 > options_.high_watermark_msgs
+            || queued_bytes_ + msg->length() > options_.high_watermark_bytes;
+        if (overflow)
+        {
+            switch (options_.overflow)
+            {
+            case overflow_policy::drop_newest:
+                stats.dropped_newest.fetch_add(1, std::memory_order_relaxed);
+                return;
+
+            case overflow_policy::disconnect:
+            {
+                // Stopping leaves the rooms, which may be iterating their
+                // participants right now, so do it from a fresh handler.
+                stats.disconnects.fetch_add(1, std::memory_order_relaxed);
+                LOG_WARN("slow session disconnected. id={}, queued={}, bytes={}", fmt::ptr(this), write_msgs_.size(), queued_bytes_);
+                disconnecting_ = true;
+                auto self(shared_from_this());
+                asio::post(socket_.get_executor(), [self]() { self->stop(); });
+                return;
+            }
+
+            case overflow_policy::drop_oldest:
+            case overflow_policy::pause_reader:
+                break;
+            }
+        }
+
+        write_msgs_.push_back(msg);
+        queued_bytes_ += msg->length();
+
+        if (overflow && options_.overflow == overflow_policy::drop_oldest)
+        {
+            // Messages in the write in flight cannot be dropped.
+            std::size_t first = writing_ ? write_batch_msgs_ : 0;
+            while (write_msgs_.size() > first + 1
+                && (write_msgs_.size() > options_.high_watermark_msgs || queued_bytes_ > options_.high_watermark_bytes))
+            {
+                queued_bytes_ -= write_msgs_[first]->length();
+                write_msgs_.erase(write_msgs_.begin() + first);
+                stats.dropped_oldest.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        else if (overflow && !congested_)
+        {
+            stats.pauses.fetch_add(1, std::memory_order_relaxed);
+            LOG_DEBUG_RATE(message_log_rate, "slow session pauses room readers. id={}, queued={}, bytes={}", fmt::ptr(this), write_msgs_.size(), queued_bytes_);
+            congested_ = true;
+            for (chat_room* room : rooms_)
+                room->pause_readers();
+        }
+    }
+
+    // Leave every room and close the socket. Safe to call more than once.
+    void stop()
+    {
+        if (stopped_)
+            return;
+        stopped_ = true;
+
+        while (!rooms_.empty())
+            leave_room(rooms_.back()->id());
+        congested_ = false;
+
+        idle_timer_.cancel();
+        write_timer_.cancel();
+
+        std::error_code ignored;
+        socket_.close(ignored);
+    }
+
+    // Reads only record the tick they completed on; the idle timer is armed
+    // once for the whole timeout and re-armed here for whatever remains of it
+    // since the last read, so a busy session never touches the wheel. A
+    // session whose reads are parked by backpressure is not idle: the server
+    // stopped reading, not the peer sending.
+    void on_idle_timer()
+    {
+        timing_wheel& timers = shard_.timers();
+        if (read_parked_)
+            last_read_ = timers.now();
+
+        std::uint64_t timeout = timers.ticks(options_.idle_timeout);
+        std::uint64_t idle = timers.now() - last_read_;
+        if (idle < timeout)
+        {
+            idle_timer_.expires_after_ticks(timeout - idle);
+            return;
+        }
+
+        server_backpressure_stats().idle_closes.fetch_add(1, std::memory_order_relaxed);
+        LOG_DEBUG_RATE(message_log_rate, "idle session closed. id={}", fmt::ptr(this));
+        stop();
+    }
+
+    // Closing the socket makes the write in flight fail, which finishes the
+    // session off.
+    void on_write_timer()
+    {
+        server_backpressure_stats().write_timeouts.fetch_add(1, std::memory_order_relaxed);
+        LOG_WARN_RATE(message_log_rate, "write timed out, session closed. id={}, queued={}, bytes={}", fmt::ptr(this),
+            write_msgs_.size(), queued_bytes_);
+        stop();
+    }
+
+    void do_read()
     {
         auto self(shared_from_this());
-        asio::async_read(socket_,
-            asio::buffer(read_msg_.data(), chat_message::header_length),
-            [this, self](std::error_code ec, std::size_t /*length*/)
+
+        if (stopped_)
+            return;
+
+        // Another session in one of our rooms is over its high watermark.
+        for (chat_room* room : rooms_)
+        {
+            if (room->readers_paused())
             {
-                if (!ec && read_msg_.decode_header())
+                read_parked_ = true;
+                room->park_reader(self);
+                return;
+            }
+        }
+
+        // A body too large for the ring is read straight into its message.
+        // deliver_frames() has already drained the ring into it at this point.
+        if (read_msg_ && read_msg_->body_length() - read_body_filled_ > read_buffer_.capacity())
+        {
+            asio::async_read(socket_,
+                asio::buffer(read_msg_->body() + read_body_filled_, read_msg_->body_length() - read_body_filled_),
+                [this, self](std::error_code ec, std::size_t length)
                 {
-                    do_read_body();
-                }
-                else
+                    if (!ec)
+                    {
+                        last_read_ = shard_.timers().now();
+                        read_body_filled_ += length;
+                        if (deliver_frames())
+                        {
+                            do_read();
+                            return;
+                        }
+                    }
+
+                    stop();
+                });
+            return;
+        }
+
+        // Otherwise read whatever the peer has sent, up to the free space in
+        // the ring, and deliver every complete frame it contains. A client that
+        // pipelines messages gets many of them handled per wakeup.
+        socket_.async_read_some(read_buffer_.prepare(),
+            [this, self](std::error_code ec, std::size_t length)
+            {
+                if (!ec)
                 {
-                    room_.leave(shared_from_this());
+                    last_read_ = shard_.timers().now();
+                    read_buffer_.commit(length);
+                    if (deliver_frames())
+                    {
+                        do_read();
+                        return;
+                    }
                 }
+
+                stop();
             });
     }
 
-    void do_read_body()
+    // Pick the connection's framing from its first bytes. Returns false until
+    // enough bytes have arrived to decide.
+    bool negotiate()
     {
-        auto self(shared_from_this());
-        asio::async_read(socket_,
-            asio::buffer(read_msg_.body(), read_msg_.body_length()),
-            [this, self](std::error_code ec, std::size_t /*length*/)
+        if (read_buffer_.size() < chat_preamble::length)
+            return false;
+
+        char data[chat_preamble::length];
+        read_buffer_.peek(data, sizeof(data));
+        std::uint8_t version = chat_preamble::decode(data);
+        if (version != 0)
+        {
+            read_buffer_.consume(sizeof(data));
+            read_format_ = wire_format::binary;
+
+            // Answer with the version both sides speak. do_write() switches the
+            // output to binary right after the preamble goes out.
+            chat_preamble::encode(preamble_, std::min(version, chat_preamble::version));
+            send_preamble_ = true;
+            if (!writing_)
+                do_write();
+        }
+
+        negotiated_ = true;
+        LOG_DEBUG("session negotiated. id={}, format={}", fmt::ptr(this), version != 0 ? "binary" : "legacy");
+        return true;
+    }
+
+    // Deliver each complete frame buffered in the ring. A frame whose body has
+    // not fully arrived stays in read_msg_ until the next read. Returns false
+    // if a header fails to decode.
+    bool deliver_frames()
+    {
+        if (!negotiated_ && !negotiate())
+            return true;
+
+        for (;;)
+        {
+            if (!read_msg_)
             {
-                if (!ec)
-                {
-                    LOG_DEBUG("message read. id={}, msg={}", fmt::ptr(self.get()), std::string_view(read_msg_.body(), read_msg_.body_length()));
+                std::size_t header_length = chat_message::header_length(read_format_);
+                if (read_buffer_.size() < header_length)
+                    return true;
 
-                    room_.deliver(read_msg_);
-                    do_read_header();
-                }
-                else
+                char header_data[chat_message::binary_header_length];
+                read_buffer_.peek(header_data, header_length);
+
+                chat_header header;
+                if (!chat_message::decode_header(read_format_, header_data, header))
+                    return false;
+                if (header.body_length > options_.max_body_bytes)
                 {
-                    room_.leave(shared_from_this());
+                    LOG_WARN_RATE(message_log_rate, "message too long, session closed. id={}, length={}, max={}", fmt::ptr(this),
+                        header.body_length, options_.max_body_bytes);
+                    return false;
                 }
-            });
+                read_buffer_.consume(header_length);
+
+                // Each message is read into its own buffer, which is handed over
+                // to the room as-is once the body is complete.
+                read_msg_ = make_chat_message(header);
+                read_body_filled_ = 0;
+            }
+
+            std::size_t n = std::min(read_buffer_.size(), read_msg_->body_length() - read_body_filled_);
+            read_buffer_.peek(read_msg_->body() + read_body_filled_, n);
+            read_buffer_.consume(n);
+            read_body_filled_ += n;
+            if (read_body_filled_ < read_msg_->body_length())
+                return true;
+
+            LOG_DEBUG_RATE(message_log_rate, "message read. id={}, room={}, type={}, msg={}", fmt::ptr(this), read_msg_->room_id(),
+                static_cast<int>(read_msg_->type()), std::string_view(read_msg_->body(), read_msg_->body_length()));
+
+            std::shared_ptr<chat_message> msg = std::move(read_msg_);
+            switch (msg->type())
+            {
+            case chat_message_type::chat:
+                if (joined_room(msg->room_id()))
+                    shard_.deliver(std::move(msg));
+                else
+                    LOG_DEBUG_RATE(message_log_rate, "message dropped, not in room. id={}, room={}", fmt::ptr(this), msg->room_id());
+                break;
+
+            case chat_message_type::join:
+                join_room(msg->room_id());
+                break;
+
+            case chat_message_type::leave:
+                leave_room(msg->room_id());
+                break;
+            }
+        }
+    }
+
+    // A session is in at most max_rooms rooms, so a linear scan is cheaper
+    // than any index.
+    chat_room* joined_room(std::uint32_t id) const
+    {
+        auto it = std::find_if(rooms_.begin(), rooms_.end(),
+            [id](const chat_room* room) { return room->id() == id; });
+        return it != rooms_.end() ? *it : nullptr;
+    }
+
+    void join_room(std::uint32_t id)
+    {
+        if (joined_room(id))
+            return;
+        if (rooms_.size() >= options_.max_rooms)
+        {
+            LOG_DEBUG_RATE(message_log_rate, "join ignored, too many rooms. id={}, room={}, max={}", fmt::ptr(this), id,
+                options_.max_rooms);
+            return;
+        }
+
+        chat_room& room = shard_.room(id);
+        rooms_.push_back(&room);
+
+        // A congested session holds a pause on every room it is in.
+        if (congested_)
+            room.pause_readers();
+        room.join(shared_from_this());
+    }
+
+    void leave_room(std::uint32_t id)
+    {
+        chat_room* room = joined_room(id);
+        if (!room)
+            return;
+
+        rooms_.erase(std::find(rooms_.begin(), rooms_.end(), room));
+        room->leave(this);
+        if (congested_)
+            room->resume_readers();
+    }
+
+    // Remove the first n queued messages, written or skipped, and resume the
+    // readers this session paused once its queue is back under both low
+    // watermarks.
+    void pop_front_msgs(std::size_t n)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+            queued_bytes_ -= write_msgs_[i]->length();
+        write_msgs_.erase(write_msgs_.begin(), write_msgs_.begin() + n);
+
+        if (congested_
+            && write_msgs_.size() <= options_.low_watermark_msgs
+            && queued_bytes_ <= options_.low_watermark_bytes)
+        {
+            congested_ = false;
+            for (chat_room* room : rooms_)
+                room->resume_readers();
+        }
     }
 
     void do_write()
     {
+        // Coalesce as much of the queue as the batch limits allow into one
+        // scatter/gather write. The batched messages stay at the front of
+        // write_msgs_ until the write completes, which keeps their bytes alive.
+        write_buffers_.clear();
+        std::size_t batch_bytes = 0;
+
+        // A history backlog lifts the limits for the write that carries it.
+        std::size_t max_batch_msgs = std::max(options_.max_write_batch_msgs, backlog_msgs_);
+        std::size_t max_batch_bytes = backlog_msgs_ != 0 ? SIZE_MAX : options_.max_write_batch_bytes;
+        backlog_msgs_ = 0;
+
+        if (send_preamble_)
+        {
+            write_buffers_.push_back(asio::buffer(preamble_));
+            batch_bytes += sizeof(preamble_);
+            send_preamble_ = false;
+            write_format_ = wire_format::binary;
+        }
+
+        // A batch made only of messages skipped for legacy framing is dropped
+        // and the next one built, until one has something to write or the
+        // queue runs out.
+        for (;;)
+        {
+            write_batch_msgs_ = 0;
+            for (const auto& msg : write_msgs_)
+            {
+                std::size_t length = msg->length(write_format_);
+                if (write_batch_msgs_ != 0
+                    && (write_batch_msgs_ >= max_batch_msgs
+                        || batch_bytes + length > max_batch_bytes))
+                    break;
+
+                ++write_batch_msgs_;
+                if (write_format_ == wire_format::binary)
+                {
+                    write_buffers_.push_back(asio::buffer(msg->data(), msg->length()));
+                }
+                else if (msg->fits_legacy())
+                {
+                    write_buffers_.push_back(asio::buffer(msg->legacy_header(), chat_message::legacy_header_length));
+                    write_buffers_.push_back(asio::buffer(msg->body(), msg->body_length()));
+                }
+                else
+                {
+                    LOG_DEBUG_RATE(message_log_rate, "message skipped, too long for legacy framing. id={}, length={}", fmt::ptr(this), msg->body_length());
+                    continue;
+                }
+                batch_bytes += length;
+            }
+
+            if (!write_buffers_.empty() || write_batch_msgs_ == 0)
+                break;
+            pop_front_msgs(write_batch_msgs_);
+        }
+
+        if (write_buffers_.empty())
+        {
+            writing_ = false;
+            return;
+        }
+
+        writing_ = true;
+        if (options_.write_timeout.count() > 0)
+            write_timer_.expires_after(options_.write_timeout);
+
         auto self(shared_from_this());
         asio::async_write(socket_,
-            asio::buffer(write_msgs_.front().data(),
-                write_msgs_.front().length()),
-            [this, self](std::error_code ec, std::size_t /*length*/)
+            const_buffer_span(write_buffers_.data(), write_buffers_.data() + write_buffers_.size()),
+            [this, self](std::error_code ec, std::size_t length)
             {
+                write_timer_.cancel();
                 if (!ec)
                 {
-                    auto& msg = write_msgs_.front();
-                    LOG_DEBUG("message write. id={}, msg={}", fmt::ptr(self.get()), std::string_view(msg.body(), msg.body_length()));
+                    LOG_DEBUG_RATE(message_log_rate, "message write. id={}, coalesced={}, bytes={}", fmt::ptr(self.get()), write_batch_msgs_, length);
 
-                    write_msgs_.pop_front();
-                    if (!write_msgs_.empty())
-                    {
-                        do_write();
-                    }
+                    ++write_flushes_;
+                    write_flushed_msgs_ += write_batch_msgs_;
+                    pop_front_msgs(write_batch_msgs_);
+                    do_write();
                 }
                 else
                 {
-                    room_.leave(shared_from_this());
+                    writing_ = false;
+                    stop();
                 }
             });
     }
 
     tcp::socket socket_;
-    chat_room& room_;
-    chat_message read_msg_;
+    chat_shard& shard_;
+    const chat_session_options& options_;
+
+    // Local replicas of the rooms this session has joined.
+    std::vector<chat_room*> rooms_;
+
+    // Read-ahead buffer, and the frame currently being decoded out of it.
+    byte_ring read_buffer_;
+    std::shared_ptr<chat_message> read_msg_;
+    std::size_t read_body_filled_;
+
+    // Framing in each direction. Both start as legacy; a client preamble moves
+    // reads to binary at once and writes once our own preamble is sent.
+    wire_format read_format_;
+    wire_format write_format_;
+    bool negotiated_;
+    bool send_preamble_;
+    char preamble_[chat_preamble::length];
+
     chat_message_queue write_msgs_;
+    bool writing_;
+
+    // Backpressure state: bytes held by write_msgs_, whether this session has
+    // paused the readers of its rooms, and whether it is being closed.
+    std::size_t queued_bytes_;
+    bool congested_;
+    bool disconnecting_;
+    bool stopped_;
+
+    // Buffers of the gathered write in flight, reused between writes, and the
+    // number of queued messages they cover.
+    std::vector<asio::const_buffer> write_buffers_;
+    std::size_t write_batch_msgs_;
+
+    // Queued messages the next write must cover in full, set when a history
+    // backlog is queued on an idle session.
+    std::size_t backlog_msgs_;
+
+    // How many gathered writes this session has made and how many messages they
+    // carried in total.
+    std::size_t write_flushes_;
+    std::size_t write_flushed_msgs_;
+
+    // Idle and write deadline timers, whether reads are parked in a room
+    // whose readers are paused, and the wheel tick of the last completed
+    // read.
+    wheel_timer idle_timer_;
+    wheel_timer write_timer_;
+    bool read_parked_;
+    std::uint64_t last_read_;
 };
 
 //----------------------------------------------------------------------
@@ -252,30 +997,149 @@ private:
 class chat_server
 {
 public:
-    chat_server(asio::io_context& io_context,
-        const tcp::endpoint& endpoint)
-        : acceptor_(io_context, endpoint)
+    chat_server(chat_shard_group& shards,
+        const tcp::endpoint& endpoint,
+        const chat_session_options& options)
+        : shards_(shards),
+        options_(options),
+        acceptor_(shards.shard(0).io_context(), endpoint)
     {
         do_accept();
     }
 
 private:
     void do_accept()
+    {
+        if (shards_.locking() != io_locking::safe)
+        {
+            do_accept_and_hand_over();
+            return;
+        }
+
+        // Accepting directly onto the chosen shard's io_context means the socket
+        // is registered with that shard's reactor from the start.
+        chat_shard& shard = shards_.pick();
+        acceptor_.async_accept(shard.io_context(),
+            [this, &shard](std::error_code ec, tcp::socket socket)
+            {
+                if (!ec)
+                {
+                    auto session = std::make_shared<chat_session>(std::move(socket), shard, options_);
+                    asio::post(shard.io_context(),
+                        [session]()
+                        {
+                            session->start();
+                        });
+                }
+
+                do_accept();
+            });
+    }
+
+    // Without reactor locks a socket may only be registered by its own shard's
+    // thread. Accept onto shard 0, then pass the bare handle through the
+    // chosen shard's mailbox for that shard to adopt.
+    void do_accept_and_hand_over()
     {
         acceptor_.async_accept(
             [this](std::error_code ec, tcp::socket socket)
             {
                 if (!ec)
                 {
-                    std::make_shared<chat_session>(std::move(socket), room_)->start();
+                    chat_shard& shard = shards_.pick();
+                    if (&shard == &shards_.shard(0))
+                    {
+                        std::make_shared<chat_session>(std::move(socket), shard, options_)->start();
+                    }
+                    else
+                    {
+                        tcp protocol = acceptor_.local_endpoint().protocol();
+                        tcp::socket::native_handle_type handle = socket.release(ec);
+                        if (ec)
+                            LOG_WARN("cannot hand over accepted socket. error={}", ec.message());
+                        else
+                            shard.mailbox().post([this, &shard, protocol, handle]() { adopt(shard, protocol, handle); });
+                    }
                 }
 
-                do_accept();
+                do_accept_and_hand_over();
             });
     }
 
+    // On shard's thread.
+    void adopt(chat_shard& shard, const tcp& protocol, tcp::socket::native_handle_type handle)
+    {
+        std::error_code ec;
+        tcp::socket socket(shard.io_context());
+        socket.assign(protocol, handle, ec);
+        if (ec)
+        {
+            LOG_WARN("cannot adopt accepted socket. error={}", ec.message());
+#if defined(ASIO_WINDOWS)
+            ::closesocket(handle);
+#else
+            ::close(handle);
+#endif
+            return;
+        }
+
+        std::make_shared<chat_session>(std::move(socket), shard, options_)->start();
+    }
+
+    chat_shard_group& shards_;
+    const chat_session_options& options_;
     tcp::acceptor acceptor_;
-    chat_room room_;
+};
+
+//----------------------------------------------------------------------
+
+// Logs the server-wide counters. Runs as a housekeeping job on shard 0.
+//
+// Messages read, and the system calls made per message by every shard, are
+// for the interval since the previous report.
+class stats_reporter
+{
+public:
+    // Construct before the shards' threads start, so that their system calls
+    // are counted.
+    explicit stats_reporter(const chat_shard_group& shards)
+        : shards_(shards),
+        messages_(0),
+        syscalls_(0)
+    {
+        if (!counter_.available())
+            LOG_WARN("system calls not counted: needs the raw_syscalls tracepoint and perf_event_open permission");
+    }
+
+    void report()
+    {
+        std::uint64_t messages = shards_.messages_read();
+        std::uint64_t syscalls = counter_.count();
+        std::uint64_t interval_messages = messages - std::exchange(messages_, messages);
+        std::uint64_t interval_syscalls = syscalls - std::exchange(syscalls_, syscalls);
+
+        std::string syscalls_per_message = "n/a";
+        if (counter_.available() && interval_messages != 0)
+            syscalls_per_message = fmt::format("{:.2f}", static_cast<double>(interval_syscalls) / interval_messages);
+
+        backpressure_stats& stats = server_backpressure_stats();
+        LOG_INFO("stats. messages={}, syscalls/message={}, dropped_oldest={}, dropped_newest={}, disconnects={}, pauses={}, idle_closes={}, write_timeouts={}, pool_reserved={}",
+            interval_messages,
+            syscalls_per_message,
+            stats.dropped_oldest.load(std::memory_order_relaxed),
+            stats.dropped_newest.load(std::memory_order_relaxed),
+            stats.disconnects.load(std::memory_order_relaxed),
+            stats.pauses.load(std::memory_order_relaxed),
+            stats.idle_closes.load(std::memory_order_relaxed),
+            stats.write_timeouts.load(std::memory_order_relaxed),
+            message_pool::reserved_bytes());
+    }
+
+private:
+    const chat_shard_group& shards_;
+    syscall_counter counter_;
+    std::uint64_t messages_;
+    std::uint64_t syscalls_;
 };
 
 //----------------------------------------------------------------------
@@ -286,23 +1150,113 @@ int main(int argc, char* argv[])
 
     try
     {
-        LOG_INFO("input port : ");
-        std::string port;
-        std::cin >> port;
+        // Usage: Example_ChatServer [--port=N] [--threads=N] [--balance=round_robin|least_load]
+        //                          [--write-batch-msgs=N] [--write-batch-bytes=N] [--read-buffer-bytes=N]
+        //                          [--max-body-bytes=N] [--max-rooms=N]
+        //                          [--high-watermark-msgs=N] [--high-watermark-bytes=N]
+        //                          [--low-watermark-msgs=N] [--low-watermark-bytes=N]
+        //                          [--overflow=drop_oldest|drop_newest|disconnect|pause_reader]
+        //                          [--history-msgs=N] [--history-bytes=N] [--room-idle-timeout=seconds]
+        //                          [--idle-timeout=seconds] [--write-timeout=seconds] [--timer-tick-ms=N]
+        //                          [--stats-interval=seconds] [--io-locking=safe|unsafe_io|unsafe]
+        //                          [--sync-log] [--binary-log=path]
+        // --threads=0 runs one shard per hardware thread. Logging is written
+        // by a background thread unless --sync-log is given. --binary-log
+        // records the LOG_* statements to path for LogDecoder instead, in a
+        // build with LIBINCLUDE_BINARY_LOG defined. --io-locking drops the
+        // locks of each shard's io_context, which only its own thread uses;
+        // see io_locking.h. The stats line reports messages read and, where
+        // syscall_counter works, system calls per message.
+        command_line args(argc, argv);
+        if (!args.get("sync-log", false))
+            spdlog_async_initialize();
+
+        std::string binary_log_path = args.get<std::string>("binary-log", "");
+        if (!binary_log_path.empty())
+        {
+#if defined(LIBINCLUDE_BINARY_LOG)
+            if (!binary_log::open(binary_log_path))
+                LOG_ERROR("cannot open binary log {}", binary_log_path);
+#else
+            LOG_WARN("--binary-log ignored: built without LIBINCLUDE_BINARY_LOG");
+#endif
+        }
+
+        std::string port = args.get<std::string>("port", "");
+        if (port.empty())
+        {
+            LOG_INFO("input port : ");
+            std::cin >> port;
+        }
+
+        std::size_t threads = args.get<std::size_t>("threads", 1);
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        shard_balance balance = args.get<std::string>("balance", "round_robin") == "least_load"
+            ? shard_balance::least_load
+            : shard_balance::round_robin;
+
+        chat_session_options options;
+        options.max_write_batch_msgs = std::max<std::size_t>(1, args.get("write-batch-msgs", options.max_write_batch_msgs));
+        options.max_write_batch_bytes = args.get("write-batch-bytes", options.max_write_batch_bytes);
+        options.read_buffer_bytes = args.get("read-buffer-bytes", options.read_buffer_bytes);
+        options.max_body_bytes = std::min<std::size_t>(chat_message::max_body_length, args.get("max-body-bytes", options.max_body_bytes));
+        options.max_rooms = std::max<std::size_t>(1, args.get("max-rooms", options.max_rooms));
+        options.high_watermark_msgs = args.get("high-watermark-msgs", options.high_watermark_msgs);
+        options.high_watermark_bytes = args.get("high-watermark-bytes", options.high_watermark_bytes);
+        options.low_watermark_msgs = std::min(options.high_watermark_msgs, args.get("low-watermark-msgs", options.low_watermark_msgs));
+        options.low_watermark_bytes = std::min(options.high_watermark_bytes, args.get("low-watermark-bytes", options.low_watermark_bytes));
+
+        std::string overflow = args.get<std::string>("overflow", "drop_oldest");
+        if (overflow == "drop_newest")
+            options.overflow = overflow_policy::drop_newest;
+        else if (overflow == "disconnect")
+            options.overflow = overflow_policy::disconnect;
+        else if (overflow == "pause_reader")
+            options.overflow = overflow_policy::pause_reader;
+        else
+            options.overflow = overflow_policy::drop_oldest;
 
-        asio::io_context io_context;
+        options.idle_timeout = std::chrono::seconds(args.get<std::int64_t>("idle-timeout", options.idle_timeout.count()));
+        options.write_timeout = std::chrono::seconds(args.get<std::int64_t>("write-timeout", options.write_timeout.count()));
+        std::chrono::milliseconds timer_tick(std::max<std::int64_t>(1, args.get<std::int64_t>("timer-tick-ms", 100)));
+
+        chat_room_options room_options;
+        room_options.history_msgs = args.get("history-msgs", room_options.history_msgs);
+        room_options.history_bytes = args.get("history-bytes", room_options.history_bytes);
+        room_options.idle_timeout = std::chrono::seconds(args.get<std::int64_t>("room-idle-timeout", room_options.idle_timeout.count()));
+
+        io_locking locking = io_locking::safe;
+        std::string locking_name = args.get<std::string>("io-locking", "safe");
+        if (!parse_io_locking(locking_name, locking))
+            LOG_WARN("unknown --io-locking={}, using safe", locking_name);
+
+        chat_shard_group shards(threads, balance, room_options, timer_tick, locking);
 
         std::list<chat_server> servers;
         tcp::endpoint endpoint(tcp::v4(), std::atoi(port.c_str()));
-        servers.emplace_back(io_context, endpoint);
+        servers.emplace_back(shards, endpoint, options);
+
+        // Periodic housekeeping shares shard 0's timing wheel instead of
+        // taking a timer each.
+        periodic_scheduler housekeeping(shards.shard(0).timers());
+        stats_reporter reporter(shards);
+        std::int64_t stats_interval = args.get<std::int64_t>("stats-interval", 10);
+        if (stats_interval > 0)
+            housekeeping.add([&reporter]() { reporter.report(); }, std::chrono::seconds(stats_interval));
 
-        LOG_INFO("Server start with port={}", endpoint.port());
-        io_context.run();
+        LOG_INFO("Server start with port={}, shards={}, balance={}, io_locking={}, io_backend={}", endpoint.port(), shards.size(),
+            balance == shard_balance::least_load ? "least_load" : "round_robin", io_locking_name(shards.locking()), io_backend_name());
+        shards.run();
     }
     catch (std::exception& e)
     {
         LOG_ERROR("Exception: {}", e.what());
     }
 
+#if defined(LIBINCLUDE_BINARY_LOG)
+    binary_log::close();
+#endif
     return 0;
 }
\ No newline at end of file
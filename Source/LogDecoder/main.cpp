@@ -0,0 +1,324 @@
+//
+// log_decoder.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Renders binary log files written by binary_log as text, one line per
+// message, with the same pattern the samples log with.
+//
+
+#include <LibInclude.h>
+#include <binary_log.h>
+#include <command_line.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <spdlog/fmt/bundled/args.h>
+#include <spdlog/pattern_formatter.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+//----------------------------------------------------------------------
+
+class log_decoder
+{
+public:
+    log_decoder(std::istream& in, std::string pattern)
+        : in_(in),
+        formatter_(std::move(pattern)),
+        messages_(0)
+    {
+    }
+
+    // Returns false if the input is not a complete binary log; everything
+    // before the damage has been printed.
+    bool run()
+    {
+        char magic[sizeof(binary_log_file::magic)];
+        if (!read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), binary_log_file::magic))
+        {
+            LOG_ERROR("decoder: not a binary log");
+            return false;
+        }
+
+        for (;;)
+        {
+            char type;
+            if (!read(&type, 1))
+                return true;
+
+            bool ok = false;
+            if (type == binary_log_file::site)
+                ok = read_site();
+            else if (type == binary_log_file::message)
+                ok = read_message();
+            else if (type == binary_log_file::dropped)
+                ok = read_dropped();
+
+            if (!ok)
+            {
+                LOG_ERROR("decoder: damaged or truncated record after {} messages", messages_);
+                return false;
+            }
+        }
+    }
+
+private:
+    struct site
+    {
+        spdlog::level::level_enum level;
+        int line;
+        std::string file;
+        std::string function;
+        std::string format;
+    };
+
+    bool read_site()
+    {
+        std::uint32_t id;
+        std::uint8_t level;
+        std::uint32_t line;
+        std::uint16_t file_size;
+        std::uint16_t function_size;
+        std::uint32_t format_size;
+        if (!get(id) || !get(level) || !get(line) || !get(file_size) || !get(function_size) || !get(format_size))
+            return false;
+        if (level >= spdlog::level::n_levels)
+            return false;
+
+        site s;
+        s.level = static_cast<spdlog::level::level_enum>(level);
+        s.line = static_cast<int>(line);
+        if (!read_string(s.file, file_size) || !read_string(s.function, function_size) || !read_string(s.format, format_size))
+            return false;
+
+        sites_[id] = std::move(s);
+        return true;
+    }
+
+    bool read_message()
+    {
+        std::uint32_t id;
+        std::int64_t time;
+        std::uint64_t thread_id;
+        std::uint32_t size;
+        if (!get(id) || !get(time) || !get(thread_id) || !get(size))
+            return false;
+
+        arguments_.resize(size);
+        if (!read(arguments_.data(), size))
+            return false;
+
+        auto it = sites_.find(id);
+        if (it == sites_.end())
+            return false;
+        const site& s = it->second;
+
+        std::string text;
+        if (!format_message(s.format, text))
+            text = fmt::format("[undecodable arguments] {}", s.format);
+
+        spdlog::details::log_msg msg(to_time_point(time),
+            spdlog::source_loc{ s.file.c_str(), s.line, s.function.c_str() }, spdlog::string_view_t(), s.level, text);
+        msg.thread_id = static_cast<std::size_t>(thread_id);
+        print(msg);
+        ++messages_;
+        return true;
+    }
+
+    bool read_dropped()
+    {
+        std::int64_t time;
+        std::uint64_t count;
+        if (!get(time) || !get(count))
+            return false;
+
+        std::string text = fmt::format("binary log dropped {} messages, ring full", count);
+        print(spdlog::details::log_msg(to_time_point(time), spdlog::source_loc(), spdlog::string_view_t(), spdlog::level::warn, text));
+        return true;
+    }
+
+    // Decode the arguments and format them with the site's format string.
+    bool format_message(const std::string& format, std::string& text)
+    {
+        fmt::dynamic_format_arg_store<fmt::format_context> store;
+        const char* p = arguments_.data();
+        const char* end = p + arguments_.size();
+        while (p != end)
+        {
+            auto type = static_cast<binary_log_arg>(*p++);
+            switch (type)
+            {
+            case binary_log_arg::boolean:
+            {
+                std::uint8_t v;
+                if (!take(p, end, v))
+                    return false;
+                store.push_back(v != 0);
+                break;
+            }
+            case binary_log_arg::character:
+            {
+                char v;
+                if (!take(p, end, v))
+                    return false;
+                store.push_back(v);
+                break;
+            }
+            case binary_log_arg::signed_integer:
+            {
+                std::int64_t v;
+                if (!take(p, end, v))
+                    return false;
+                store.push_back(v);
+                break;
+            }
+            case binary_log_arg::unsigned_integer:
+            {
+                std::uint64_t v;
+                if (!take(p, end, v))
+                    return false;
+                store.push_back(v);
+                break;
+            }
+            case binary_log_arg::float32:
+            {
+                float v;
+                if (!take(p, end, v))
+                    return false;
+                store.push_back(v);
+                break;
+            }
+            case binary_log_arg::float64:
+            {
+                double v;
+                if (!take(p, end, v))
+                    return false;
+                store.push_back(v);
+                break;
+            }
+            case binary_log_arg::string:
+            {
+                std::uint32_t size;
+                if (!take(p, end, size) || static_cast<std::size_t>(end - p) < size)
+                    return false;
+                store.push_back(std::string(p, size));
+                p += size;
+                break;
+            }
+            case binary_log_arg::pointer:
+            {
+                std::uint64_t v;
+                if (!take(p, end, v))
+                    return false;
+                store.push_back(reinterpret_cast<const void*>(static_cast<std::uintptr_t>(v)));
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+
+        try
+        {
+            text = fmt::vformat(format, store);
+            return true;
+        }
+        catch (const fmt::format_error&)
+        {
+            return false;
+        }
+    }
+
+    void print(const spdlog::details::log_msg& msg)
+    {
+        spdlog::memory_buf_t line;
+        formatter_.format(msg, line);
+        std::fwrite(line.data(), 1, line.size(), stdout);
+    }
+
+    static spdlog::log_clock::time_point to_time_point(std::int64_t ns)
+    {
+        return spdlog::log_clock::time_point(
+            std::chrono::duration_cast<spdlog::log_clock::duration>(std::chrono::nanoseconds(ns)));
+    }
+
+    template <typename V>
+    static bool take(const char*& p, const char* end, V& value)
+    {
+        if (static_cast<std::size_t>(end - p) < sizeof(value))
+            return false;
+        std::memcpy(&value, p, sizeof(value));
+        p += sizeof(value);
+        return true;
+    }
+
+    template <typename V>
+    bool get(V& value)
+    {
+        return read(&value, sizeof(value));
+    }
+
+    bool read_string(std::string& s, std::size_t size)
+    {
+        s.resize(size);
+        return read(s.data(), size);
+    }
+
+    bool read(void* destination, std::size_t size)
+    {
+        in_.read(static_cast<char*>(destination), static_cast<std::streamsize>(size));
+        return static_cast<std::size_t>(in_.gcount()) == size;
+    }
+
+    std::istream& in_;
+    spdlog::pattern_formatter formatter_;
+    std::unordered_map<std::uint32_t, site> sites_;
+    std::vector<char> arguments_;
+    std::uint64_t messages_;
+};
+
+//----------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    // Decoded records are the only thing written to stdout; the decoder's own
+    // messages go to stderr, so redirecting stdout captures just the log.
+    spdlog::set_default_logger(std::make_shared<spdlog::logger>("", std::make_shared<spdlog::sinks::stderr_color_sink_mt>()));
+    spdlog_default_initialize();
+
+    try
+    {
+        // Usage: LogDecoder <file> [--pattern=spdlog pattern]
+        // The default pattern is the one spdlog_default_initialize() sets.
+        command_line args(argc, argv);
+        if (args.positional_count() != 1)
+        {
+            LOG_ERROR("Usage: LogDecoder <file> [--pattern=spdlog pattern]");
+            return 1;
+        }
+
+        std::ifstream in(args.positional(0), std::ios::binary);
+        if (!in)
+        {
+            LOG_ERROR("decoder: cannot open {}", args.positional(0));
+            return 1;
+        }
+
+        log_decoder decoder(in, args.get<std::string>("pattern", "%Y-%m-%d %H:%M:%S.%e | %L | %t | %v | %s:%#"));
+        return decoder.run() ? 0 : 1;
+    }
+    catch (std::exception& e)
+    {
+        LOG_ERROR("Exception: {}", e.what());
+    }
+
+    return 1;
+}
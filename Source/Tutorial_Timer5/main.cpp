@@ -10,21 +10,23 @@
 
 #include <asio/asio.hpp>
 #include <LibInclude.h>
+#include <periodic_scheduler.h>
 
+// The two timers are two jobs of one periodic_scheduler. Its wheel runs them
+// through the strand, so they never run concurrently even though two threads
+// run the io_context, and fixed_rate keeps each on its one second grid as the
+// expires_at(expiry() + 1s) re-arming did.
 class printer
 {
 public:
     printer(asio::io_context& io)
         : strand_(asio::make_strand(io)),
-        timer1_(io, asio::chrono::seconds(1)),
-        timer2_(io, asio::chrono::seconds(1)),
+        wheel_(strand_, asio::chrono::milliseconds(10)),
+        scheduler_(wheel_),
         count_(0)
     {
-        timer1_.async_wait(asio::bind_executor(strand_,
-            std::bind(&printer::print1, this)));
-
-        timer2_.async_wait(asio::bind_executor(strand_,
-            std::bind(&printer::print2, this)));
+        scheduler_.add(std::bind(&printer::print1, this), asio::chrono::seconds(1));
+        scheduler_.add(std::bind(&printer::print2, this), asio::chrono::seconds(1));
     }
 
     ~printer()
@@ -38,11 +40,10 @@ public:
         {
             LOG_INFO("Timer 1: {}", count_);
             ++count_;
-
-            timer1_.expires_at(timer1_.expiry() + asio::chrono::seconds(1));
-
-            timer1_.async_wait(asio::bind_executor(strand_,
-                std::bind(&printer::print1, this)));
+        }
+        else
+        {
+            scheduler_.cancel_all();
         }
     }
 
@@ -52,18 +53,17 @@ public:
         {
             LOG_INFO("Timer 2: {}", count_);
             ++count_;
-
-            timer2_.expires_at(timer2_.expiry() + asio::chrono::seconds(1));
-
-            timer2_.async_wait(asio::bind_executor(strand_,
-                std::bind(&printer::print2, this)));
+        }
+        else
+        {
+            scheduler_.cancel_all();
         }
     }
 
 private:
     asio::strand<asio::io_context::executor_type> strand_;
-    asio::steady_timer timer1_;
-    asio::steady_timer timer2_;
+    timing_wheel wheel_;
+    periodic_scheduler scheduler_;
     int count_;
 };
 